@@ -14,250 +14,914 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "grubchess.h"
 #include "ai.h"
+#include "bitboard.h"
 #include "hashtable.h"
 
 #define SCORE_FRAC 100
 const int CLASSIC_PIECE_VALUE[] = {0,1,3,3,5,9,1000};
+// Score of being mated at the root, less one per ply to the mate.
+const int CHECKMATE_SCORE = 1000 * SCORE_FRAC;
 const int CHECKMATE_SCORE_THRESHOLD = 500 * SCORE_FRAC;
-int score_material(const Board* board) {
-  int total = 0;
-  for(int rank=0; rank<BOARD_WIDTH; rank++) {
-    for(int file=0; file<BOARD_WIDTH; file++) {
-      Position pos = {rank, file};
-      Square square = get_square(board, pos);
-      int valence = square.color == WHITE? 1 : -1;
-      total += valence * CLASSIC_PIECE_VALUE[square.piece]*SCORE_FRAC;
+const int BITBASE_WIN_SCORE = 200 * SCORE_FRAC;
+// Most a quiet position can gain besides the captured material.
+const int DELTA_MARGIN = 2 * SCORE_FRAC;
+int PIECE_SQUARE_SCORES[NUM_COLORS][NUM_PIECES][BOARD_WIDTH * BOARD_WIDTH];
+
+// Points for pawn advancement, by ranks left to promotion.
+const int PAWN_ADVANCEMENT[] = {SCORE_FRAC, 2 * SCORE_FRAC / 3, SCORE_FRAC / 3};
+
+void init_evaluation() {
+  for(int color=0; color<NUM_COLORS; color++) {
+    int valence = color == WHITE? 1 : -1;
+    int target_rank = (color == WHITE) * 7;
+    for(int piece=0; piece<NUM_PIECES; piece++) {
+      for(int square=0; square<BOARD_WIDTH*BOARD_WIDTH; square++) {
+        int score = CLASSIC_PIECE_VALUE[piece]*SCORE_FRAC;
+        int distance = abs(square / BOARD_WIDTH - target_rank);
+        if(piece == PAWN && distance < 3) {
+          score += PAWN_ADVANCEMENT[distance];
+        }
+        PIECE_SQUARE_SCORES[color][piece][square] = valence * score;
+      }
     }
   }
+}
+
+int compute_material(const Board* board) {
+  int total = 0;
+  for(int square=0; square<BOARD_WIDTH*BOARD_WIDTH; square++) {
+    Square sqr = board->squares[square];
+    total += PIECE_SQUARE_SCORES[sqr.color][sqr.piece][square];
+  }
   return total;
 }
 
-int score_see(const Board* board) {
-  Board fixed_move = *board;
-  ThreatsBoard threats[NUM_COLORS];
-  for(int rank=0; rank<BOARD_WIDTH; rank++) {
-    for(int file=0; file<BOARD_WIDTH; file++) {
-      Position pos = {rank, file};
-      for(int color=0; color<NUM_COLORS; color++) {
-        *get_threat_board(&threats[color], pos) = 0;
-      }
-    }
+// Material a capture wins once every recapture on the target square has
+// been played out, least valuable attacker first, with either side free to
+// stop capturing. Sliders behind the capturers join in as the way opens.
+int see(const Board* board, Move move) {
+  int from = square_index(move.from);
+  int to = square_index(move.to);
+  enum Piece on_square = get_square(board, move.from).piece;
+  Bitboard occupied = occupancy(board) ^ square_bit(from);
+  int gain[32];
+  gain[0] = CLASSIC_PIECE_VALUE[get_square(board, move.to).piece] * SCORE_FRAC;
+  if(on_square == PAWN && move.from.file != move.to.file && gain[0] == 0) {
+    gain[0] = CLASSIC_PIECE_VALUE[PAWN] * SCORE_FRAC; // En passant.
+    occupied ^= square_bit(square_index((Position) {move.from.rank, move.to.file}));
   }
-  
-  for(int rank=0; rank<BOARD_WIDTH; rank++) {
-    for(int file=0; file<BOARD_WIDTH; file++) {
-      Position pos = {rank, file};
-      Square square = get_square(&fixed_move, pos);
-      ThreatsBoard* t = &threats[square.color];
-
-      for(int color=0; color<NUM_COLORS; color++) {
-        fixed_move.move = color;
-        set_square(&fixed_move, pos, (Square) {square.piece, color});
-        valid_moves_from(&fixed_move, pos, sum_threats_callback, t);
-      }
-      set_square(&fixed_move, pos, square);
-    }
+  if(is_promotion(board, move)) {
+    gain[0] += (CLASSIC_PIECE_VALUE[QUEEN] - CLASSIC_PIECE_VALUE[PAWN]) * SCORE_FRAC;
+    on_square = QUEEN;
   }
-  
-  int total_score = 0;
-  for(int rank=0; rank<BOARD_WIDTH; rank++) {
-    for(int file=0; file<BOARD_WIDTH; file++) {
-      Position pos = {rank, file};
-      Square square = get_square(board, pos);
-      if(square.piece != EMPTY) {
-        const int valence = square.color == WHITE ? 1:-1;
-        const int white_threat = *get_threat_board(&threats[WHITE], pos);
-        const int black_threat = *get_threat_board(&threats[BLACK], pos);
-        const int threat = white_threat - black_threat;
-        //printf("total threat! %c %d %d %d %d\n", square_to_char(square), white_threat, black_threat, threat, threat*valence);
-        const int piece_value = valence * CLASSIC_PIECE_VALUE[square.piece];
-        int multiplier = SCORE_FRAC;
-        //Undefended pieces are worth 80% of their value on your turn,
-        //20% of their value on enemy turn.
-        if(threat * valence < 0) {
-          if(square.color == board->move) {
-            multiplier = SCORE_FRAC * 8 / 10;
-          } else {
-            multiplier = SCORE_FRAC * 2 / 10;
-          }
-        }
-        total_score += piece_value * multiplier;
-      }
+
+  Bitboard diagonal = board->pieces[BISHOP] | board->pieces[QUEEN];
+  Bitboard straight = board->pieces[ROOK] | board->pieces[QUEEN];
+  Bitboard attackers = attackers_to(board, to, occupied) & occupied;
+  enum Color side = enemy_color(get_square(board, move.from).color);
+  int depth = 0;
+  while(depth < 31) {
+    Bitboard mine = attackers & board->colors[side];
+    if(!mine) {
+      break;
+    }
+    enum Piece piece = PAWN;
+    while(!(mine & board->pieces[piece])) {
+      piece++;
     }
+    // side captures whatever stands on the square, risking piece.
+    depth++;
+    gain[depth] = CLASSIC_PIECE_VALUE[on_square] * SCORE_FRAC - gain[depth - 1];
+    occupied ^= square_bit(lsb(mine & board->pieces[piece]));
+    attackers |= (bishop_attacks(to, occupied) & diagonal) | (rook_attacks(to, occupied) & straight);
+    attackers &= occupied;
+    on_square = piece;
+    side = enemy_color(side);
   }
-
-  return total_score;
+  // Walk back up, letting each side stop capturing if that's better for it.
+  while(depth > 0) {
+    int stop = -gain[depth - 1];
+    gain[depth - 1] = -(stop > gain[depth] ? stop : gain[depth]);
+    depth--;
+  }
+  return gain[0];
 }
 
+// Number of pseudo-legal moves color could make, counted from attack sets
+// rather than by generating them. Castling and en passant are left out.
+int count_mobility(const Board* board, enum Color color) {
+  Bitboard own = board->colors[color];
+  Bitboard enemies = board->colors[enemy_color(color)];
+  Bitboard occupied = own | enemies;
+  int moves = 0;
+
+  Bitboard pawns = pieces_of(board, PAWN, color);
+  Bitboard single, twice, west, east;
+  if(color == WHITE) {
+    single = (pawns << BOARD_WIDTH) & ~occupied;
+    twice = ((single & (RANK_1_BB << 2 * BOARD_WIDTH)) << BOARD_WIDTH) & ~occupied;
+    west = ((pawns & ~FILE_A_BB) << (BOARD_WIDTH - 1)) & enemies;
+    east = ((pawns & ~(FILE_A_BB << 7)) << (BOARD_WIDTH + 1)) & enemies;
+  } else {
+    single = (pawns >> BOARD_WIDTH) & ~occupied;
+    twice = ((single & (RANK_1_BB << 5 * BOARD_WIDTH)) >> BOARD_WIDTH) & ~occupied;
+    west = ((pawns & ~FILE_A_BB) >> (BOARD_WIDTH + 1)) & enemies;
+    east = ((pawns & ~(FILE_A_BB << 7)) >> (BOARD_WIDTH - 1)) & enemies;
+  }
+  moves += popcount(single) + popcount(twice) + popcount(west) + popcount(east);
 
-
-void count_moves_callback(const Board* board, Position from, Position to, void* data) {
-  int* moves = (int*)data;
-  (*moves)++;
+  Bitboard knights = pieces_of(board, KNIGHT, color);
+  while(knights) {
+    moves += popcount(KNIGHT_ATTACKS[pop_lsb(&knights)] & ~own);
+  }
+  Bitboard diagonal = (board->pieces[BISHOP] | board->pieces[QUEEN]) & own;
+  while(diagonal) {
+    moves += popcount(bishop_attacks(pop_lsb(&diagonal), occupied) & ~own);
+  }
+  Bitboard straight = (board->pieces[ROOK] | board->pieces[QUEEN]) & own;
+  while(straight) {
+    moves += popcount(rook_attacks(pop_lsb(&straight), occupied) & ~own);
+  }
+  Bitboard kings = pieces_of(board, KING, color);
+  while(kings) {
+    moves += popcount(KING_ATTACKS[pop_lsb(&kings)] & ~own);
+  }
+  return moves;
 }
 
 int score_activity(const Board* board) {
-  Board fixed_move = *board;
-
-  int possible_moves[NUM_COLORS] = {0};
-  for(int color=0; color<NUM_COLORS; color++) {
-    fixed_move.move = color;
-    valid_moves(&fixed_move, count_moves_callback, &possible_moves[color]);
-  }
-  
-  int score = possible_moves[WHITE] - possible_moves[BLACK];
+  int score = count_mobility(board, WHITE) - count_mobility(board, BLACK);
   return score*SCORE_FRAC / 100;
 }
 
-int score_pawn_advancement(const Board* board) {
-  int total_score = 0;
-  for(int rank=0; rank<BOARD_WIDTH; rank++) {
-    for(int file=0; file<BOARD_WIDTH; file++) {
-      Position pos = {rank, file};
-      Square square = get_square(board, pos);
-      int valence = square.color == WHITE? 1:-1;
-      int target_rank = (square.color == WHITE) * 7;
-      if(square.piece == PAWN) {
-        int distance = abs(pos.rank - target_rank);
-        int score = 3-distance;
-        if(score<0) score = 0;
-        total_score += score * valence;
-      }
-    }
-  }
-  return total_score * SCORE_FRAC / 3;
+int score(const Board* board) {
+  return board->material + score_activity(board);
 }
 
-int score(const Board* board) {
-  return score_material(board) + score_activity(board) + score_pawn_advancement(board);
+// Known wins rank below mates but above any material balance. Among them,
+// material and a lone king driven to the edge and met by ours lead towards
+// a mate the search can see.
+int bitbase_score(const Board* board, enum Color strong, bool win) {
+  if(!win) {
+    return 0;
+  }
+  int valence = strong == WHITE ? 1 : -1;
+  Position weak = index_position(lsb(pieces_of(board, KING, enemy_color(strong))));
+  Position king = index_position(lsb(pieces_of(board, KING, strong)));
+  int edge = abs(2 * weak.rank - 7) > abs(2 * weak.file - 7) ? abs(2 * weak.rank - 7) : abs(2 * weak.file - 7);
+  int distance = abs(weak.rank - king.rank) > abs(weak.file - king.file) ? abs(weak.rank - king.rank) : abs(weak.file - king.file);
+  return board->material + valence * (BITBASE_WIN_SCORE + 10 * edge - 5 * distance);
 }
 
 bool score_is_checkmate(int score) {
   return score < -CHECKMATE_SCORE_THRESHOLD || score > CHECKMATE_SCORE_THRESHOLD;
 }
 
-typedef struct SearchCallbackData {
-  HashTable* table;
+int checkmate_plies(int score) {
+  return CHECKMATE_SCORE - abs(score);
+}
+
+// The table stores mate scores relative to the node rather than the root,
+// so they stay right when the position is reached at another ply.
+int score_to_table(int score, int ply) {
+  if(score > CHECKMATE_SCORE_THRESHOLD) {
+    return score + ply;
+  } else if(score < -CHECKMATE_SCORE_THRESHOLD) {
+    return score - ply;
+  }
+  return score;
+}
+
+int score_from_table(int score, int ply) {
+  if(score > CHECKMATE_SCORE_THRESHOLD) {
+    return score - ply;
+  } else if(score < -CHECKMATE_SCORE_THRESHOLD) {
+    return score + ply;
+  }
+  return score;
+}
+
+SearchOptions search_options = {.null_move = true, .late_move_reductions = true};
+
+// Alpha-beta state of one node, scored from white's point of view.
+typedef struct SearchNode {
+  int ply;
   int max_depth;
   int alphabeta[NUM_COLORS];
-  Move* best_move;
-} SearchCallbackData;
+  Move best_move;
+  // Whether every move so far followed the previous principal variation.
+  bool on_pv;
+  int stand_pat; // Static score, used in quiescence.
+  // Side to move is in check. Quiescence then searches every evasion
+  // instead of standing pat, so mates at the horizon are seen.
+  bool check;
+  int searched; // Moves searched so far.
+} SearchNode;
+
+enum PickStage {
+  PICK_FIRST_MOVES,
+  PICK_GENERATE,
+  PICK_GOOD_CAPTURES,
+  PICK_KILLERS,
+  PICK_QUIETS,
+  PICK_BAD_CAPTURES,
+  PICK_DONE
+};
+
+// Hands out the moves of a node lazily, best guesses first: the previous PV
+// and table moves, captures that win material by MVV-LVA, killers, quiet
+// moves by history score and finally captures that lose material. Moves are
+// only generated if the first moves don't cut off, and each stage picks its
+// best remaining move on demand instead of sorting up front.
+typedef struct MovePicker {
+  enum PickStage stage;
+  bool quiescence; // Skip quiet moves and losing captures.
+  Move first_moves[2];
+  Move killers[2];
+  int index;
+  // moves[0..tactical) are captures and promotions, the rest are quiet.
+  int tactical;
+  // moves[bad_captures..tactical) are captures set aside as losing material.
+  int bad_captures;
+  MoveList* moves;
+  int* scores;
+} MovePicker;
+
+int minimax_node(SearchThread* thread, int ply, int max_depth, int alpha, int beta, bool on_pv);
+bool is_tactical(const Board* board, Move move);
+
+bool search_stopped(const SearchThread* thread) {
+  return atomic_load_explicit(&thread->control->stop, memory_order_relaxed);
+}
 
+void check_limits(SearchThread* thread) {
+  SearchControl* control = thread->control;
+  uint64_t nodes = atomic_fetch_add(&control->nodes, LIMIT_CHECK_INTERVAL) + LIMIT_CHECK_INTERVAL;
+  // Only the main thread enforces limits, and never before it has a move.
+  if(thread->id != 0 || control->completed_depth == 0) {
+    return;
+  }
+  if((control->node_limit && nodes >= control->node_limit)
+     || (control->deadline && time_ms() >= control->deadline)
+     || (control->external_stop && atomic_load(control->external_stop))) {
+    atomic_store(&control->stop, true);
+  }
+}
 
-void search_stand_pat(const Board* board, SearchCallbackData* data, int current_score) {
+void search_stand_pat(const Board* board, SearchNode* node, int current_score) {
   int valence = board->move == WHITE ? 1:-1;
   // If standing pat satisfies the enemy cutoff
-  if((current_score - data->alphabeta[board->move]) * valence > 0) {
-    data->alphabeta[board->move] = current_score;
-    // Dummy move to indicate stand pat evaluation.
-    data->best_move[0]= (Move){{0,0},{1,1}};
+  if((current_score - node->alphabeta[board->move]) * valence > 0) {
+    node->alphabeta[board->move] = current_score;
   }
 }
 
-void search_callback(const Board* board, Position from, Position to, void* d) {
-  SearchCallbackData* data = (SearchCallbackData*)d;
-  if(data->alphabeta[WHITE] >= data->alphabeta[BLACK]) {
-    //printf("Pruned %d %d\n", data->alphabeta[WHITE], data->alphabeta[BLACK]);
+// The child's line, prefixed by move, becomes this ply's principal variation.
+void update_pv(SearchThread* thread, int ply, Move move) {
+  Move* pv = thread->pv[ply];
+  const Move* child_pv = thread->pv[ply + 1];
+  pv[ply] = move;
+  for(int i = ply + 1; i < thread->pv_length[ply + 1]; i++) {
+    pv[i] = child_pv[i];
+  }
+  thread->pv_length[ply] = thread->pv_length[ply + 1];
+}
+
+void search_move(SearchThread* thread, SearchNode* node, Move move, int reduction) {
+  Board* board = &thread->board;
+  if(node->alphabeta[WHITE] >= node->alphabeta[BLACK]) {
+    //printf("Pruned %d %d\n", node->alphabeta[WHITE], node->alphabeta[BLACK]);
     return;
   }
 
-  Square to_square = get_square(board, to);
-  if(data->max_depth <= 0 && to_square.piece == EMPTY) {
+  enum Color color = board->move;
+  int valence = color == WHITE? 1: -1;
+
+  if(node->max_depth <= 0 && !node->check) {
+    // Captures, en passant included, and promotions.
+    if(!is_tactical(board, move)) {
+      return;
+    }
+    // Delta pruning: skip captures that can't raise the stand pat score to
+    // our bound, even with a margin for positional gains.
+    enum Piece victim = get_square(board, move.to).piece;
+    if(victim == EMPTY && get_square(board, move.from).piece == PAWN && move.from.file != move.to.file) {
+      victim = PAWN; // En passant.
+    }
+    int gain = CLASSIC_PIECE_VALUE[victim] * SCORE_FRAC + DELTA_MARGIN;
+    if(is_promotion(board, move)) {
+      gain += (CLASSIC_PIECE_VALUE[QUEEN] - CLASSIC_PIECE_VALUE[PAWN]) * SCORE_FRAC;
+    }
+    if((node->stand_pat + valence * gain - node->alphabeta[color]) * valence <= 0) {
+      return;
+    }
+  }
+
+  Undo* undo = &thread->stack[node->ply].undo;
+  make_move(board, move, undo);
+  bool child_on_pv = node->on_pv && move_equal(move, thread->pv_seed[node->ply]);
+  int alpha = node->alphabeta[WHITE];
+  int beta = node->alphabeta[BLACK];
+  int depth = node->max_depth - 1;
+  int new_score;
+  if(node->searched == 0 || node->max_depth <= 0) {
+    new_score = minimax_node(thread, node->ply + 1, depth, alpha, beta, child_on_pv);
+  } else {
+    // Principal variation search: the first move is probably best, so only
+    // prove the others can't beat it with a null window around our bound,
+    // and search them properly if they can. Late quiet moves are tried at
+    // reduced depth first.
+    int null_alpha = color == WHITE ? alpha : beta - 1;
+    new_score = minimax_node(thread, node->ply + 1, depth - reduction, null_alpha, null_alpha + 1, false);
+    if(reduction > 0 && (new_score - node->alphabeta[color]) * valence > 0 && !search_stopped(thread)) {
+      STAT(thread, lmr_researches);
+      new_score = minimax_node(thread, node->ply + 1, depth, null_alpha, null_alpha + 1, false);
+    }
+    if(new_score > alpha && new_score < beta && beta - alpha > 1 && !search_stopped(thread)) {
+      new_score = minimax_node(thread, node->ply + 1, depth, alpha, beta, child_on_pv);
+    }
+  }
+  node->searched++;
+  unmake_move(board, move, undo);
+  if(search_stopped(thread)) {
     return;
   }
-  //printf("score: %d\n", score(board));
-  //print_board(board);
 
-  
-  int valence = board->move == WHITE? 1: -1;
+  if((new_score - node->alphabeta[color]) * valence > 0) {
+    node->alphabeta[color] = new_score;
+    node->best_move = move;
+    update_pv(thread, node->ply, move);
+  }
+}
 
-  Board new_board = *board;
-  //print_move(board, from, to);
-  apply_valid_move(&new_board, from, to);
 
-  int child_depth = data->max_depth - 1;
-  Move child_moves[child_depth+100];
-  memset(child_moves, 0, sizeof(Move)*(child_depth+100));
-  int new_score = minimax_score(data->table, &new_board, child_depth, data->alphabeta[WHITE], data->alphabeta[BLACK], child_moves);
+// Null move pruning: if passing the turn still fails high after a reduced
+// search, a real move would too. Not when in check, right after another
+// null move, or with only pawns left, where zugzwang makes passing the best
+// move. Returns whether the node was cut off.
+bool try_null_move(SearchThread* thread, SearchNode* node) {
+  Board* board = &thread->board;
+  enum Color color = board->move;
+  enum Color enemy = enemy_color(color);
+  int valence = color == WHITE? 1: -1;
+  int bound = node->alphabeta[enemy];
+  if(node->ply == 0 || node->max_depth < NULL_MOVE_MIN_DEPTH || node->check
+     || node->alphabeta[BLACK] - node->alphabeta[WHITE] > 1
+     || thread->stack[node->ply - 1].null_move
+     || !(board->colors[color] & ~board->pieces[PAWN] & ~board->pieces[KING])
+     || (node->stand_pat - bound) * valence < 0) {
+    return false;
+  }
 
-  Move move = {from, to};
+  STAT(thread, null_move_tries);
+  Undo* undo = &thread->stack[node->ply].undo;
+  make_null_move(board, undo);
+  thread->stack[node->ply].null_move = true;
+  int reduction = node->max_depth > 6 ? NULL_MOVE_REDUCTION + 1 : NULL_MOVE_REDUCTION;
+  int depth = node->max_depth - 1 - reduction;
+  int null_alpha = color == WHITE ? bound - 1 : bound;
+  int score = minimax_node(thread, node->ply + 1, depth, null_alpha, null_alpha + 1, false);
+  thread->stack[node->ply].null_move = false;
+  unmake_null_move(board, undo);
+  return !search_stopped(thread) && (score - bound) * valence >= 0;
+}
 
-  if((new_score - data->alphabeta[board->move]) * valence > 0) {
-    data->alphabeta[board->move] = new_score;
-    data->best_move[0] = move;
-    for(int i=0; i<child_depth+100; i++) {
-      data->best_move[i+1] = child_moves[i];
-    }
+// Depth taken off the searched-th move of a node, more for deeper nodes and
+// later moves.
+int late_move_reduction(int depth, int searched) {
+  if(depth < LMR_MIN_DEPTH || searched < LMR_MIN_MOVES) {
+    return 0;
+  }
+  int log_depth = 31 - __builtin_clz(depth);
+  int log_searched = 31 - __builtin_clz(searched);
+  int reduction = 1 + log_depth * log_searched / 4;
+  // Always leave at least one ply before quiescence.
+  return reduction < depth - 2 ? reduction : depth - 2;
+}
+
+bool is_tactical(const Board* board, Move move) {
+  Square square = get_square(board, move.from);
+  if(square.piece == PAWN) {
+    // Promotions, and en passant captures onto an empty square.
+    return move.to.rank == 0 || move.to.rank == 7 || move.from.file != move.to.file;
+  }
+  return occupied(board, move.to);
+}
+
+int mvv_lva(const Board* board, Move move) {
+  enum Piece attacker = get_square(board, move.from).piece;
+  enum Piece victim = get_square(board, move.to).piece;
+  if(attacker == PAWN && (move.to.rank == 0 || move.to.rank == 7)) {
+    victim = victim > QUEEN ? victim : QUEEN;
+  } else if(victim == EMPTY) {
+    victim = PAWN; // En passant.
   }
+  return victim * NUM_PIECES - attacker;
+}
+
+// A capture is good if it doesn't lose material in the exchange.
+bool good_capture(const Board* board, Move move) {
+  Square attacker = get_square(board, move.from);
+  Square victim = get_square(board, move.to);
+  if(CLASSIC_PIECE_VALUE[victim.piece] >= CLASSIC_PIECE_VALUE[attacker.piece]) {
+    return true;
+  }
+  return see(board, move) >= 0;
+}
+
+void init_move_picker(MovePicker* picker, SearchThread* thread, int ply, Move pv_move, Move hash_move, bool quiescence) {
+  picker->stage = PICK_FIRST_MOVES;
+  picker->quiescence = quiescence;
+  picker->first_moves[0] = pv_move;
+  picker->first_moves[1] = move_equal(hash_move, pv_move) ? (Move){{0,0},{0,0}} : hash_move;
+  picker->killers[0] = thread->killers[ply][0];
+  picker->killers[1] = thread->killers[ply][1];
+  picker->index = 0;
+  picker->moves = &thread->stack[ply].moves;
+  picker->scores = thread->stack[ply].scores;
 }
 
+void swap_moves(MovePicker* picker, int i, int j) {
+  Move move = picker->moves->moves[i];
+  int score = picker->scores[i];
+  picker->moves->moves[i] = picker->moves->moves[j];
+  picker->scores[i] = picker->scores[j];
+  picker->moves->moves[j] = move;
+  picker->scores[j] = score;
+}
 
-int move_order_comparator(const void* m1, const void* m2, void* b) {
-  const Move* move1 = (const Move*) m1;
-  const Move* move2 = (const Move*) m2;
-  const Board* board = (const Board*) b;
-  Square square1 = get_square(board, move1->to);
-  Square square2 = get_square(board, move2->to);
+// Moves the best scored move of [start, end) to start.
+void pick_best(MovePicker* picker, int start, int end) {
+  int best = start;
+  for(int i=start+1; i<end; i++) {
+    if(picker->scores[i] > picker->scores[best]) {
+      best = i;
+    }
+  }
+  swap_moves(picker, start, best);
+}
 
-  int capture_diff = CLASSIC_PIECE_VALUE[square2.piece] - CLASSIC_PIECE_VALUE[square1.piece];
+bool already_picked(const MovePicker* picker, Move move, bool include_killers) {
+  if(move_equal(move, picker->first_moves[0]) || move_equal(move, picker->first_moves[1])) {
+    return true;
+  }
+  return include_killers && (move_equal(move, picker->killers[0]) || move_equal(move, picker->killers[1]));
+}
 
-  return capture_diff;
+bool next_move(MovePicker* picker, SearchThread* thread, Move* move) {
+  const Board* board = &thread->board;
+  MoveList* moves = picker->moves;
+  Move nullmove = {{0,0},{0,0}};
+  while(true) {
+    switch(picker->stage) {
+      case PICK_FIRST_MOVES:
+        while(picker->index < 2) {
+          Move candidate = picker->first_moves[picker->index++];
+          if(!move_equal(candidate, nullmove) && move_valid(board, candidate)) {
+            *move = candidate;
+            return true;
+          }
+        }
+        picker->stage = PICK_GENERATE;
+        break;
+      case PICK_GENERATE:
+        STAT(thread, move_generations);
+        if(picker->quiescence) {
+          generate_captures(board, moves);
+        } else {
+          generate_moves(board, moves);
+        }
+        // Partition tactical moves to the front and score them.
+        picker->tactical = 0;
+        for(int i=0; i<moves->count; i++) {
+          if(is_tactical(board, moves->moves[i])) {
+            Move tactical = moves->moves[i];
+            moves->moves[i] = moves->moves[picker->tactical];
+            moves->moves[picker->tactical] = tactical;
+            picker->scores[picker->tactical++] = mvv_lva(board, tactical);
+          }
+        }
+        picker->index = 0;
+        picker->bad_captures = picker->tactical;
+        picker->stage = PICK_GOOD_CAPTURES;
+        break;
+      case PICK_GOOD_CAPTURES:
+        while(picker->index < picker->bad_captures) {
+          pick_best(picker, picker->index, picker->bad_captures);
+          Move candidate = moves->moves[picker->index];
+          if(!good_capture(board, candidate)) {
+            // Set aside behind the remaining captures for PICK_BAD_CAPTURES.
+            picker->bad_captures--;
+            swap_moves(picker, picker->index, picker->bad_captures);
+            continue;
+          }
+          picker->index++;
+          if(!already_picked(picker, candidate, false)) {
+            *move = candidate;
+            return true;
+          }
+        }
+        // Quiescence never plays captures that lose material.
+        picker->index = 0;
+        picker->stage = picker->quiescence ? PICK_DONE : PICK_KILLERS;
+        break;
+      case PICK_KILLERS:
+        while(picker->index < 2) {
+          Move killer = picker->killers[picker->index++];
+          if(!move_equal(killer, nullmove) && !already_picked(picker, killer, false)
+             && move_valid(board, killer) && !is_tactical(board, killer)) {
+            *move = killer;
+            return true;
+          }
+        }
+        for(int i=picker->tactical; i<moves->count; i++) {
+          Move quiet = moves->moves[i];
+          picker->scores[i] = thread->history[board->move][square_index(quiet.from)][square_index(quiet.to)];
+        }
+        picker->index = picker->tactical;
+        picker->stage = PICK_QUIETS;
+        break;
+      case PICK_QUIETS:
+        while(picker->index < moves->count) {
+          pick_best(picker, picker->index, moves->count);
+          Move candidate = moves->moves[picker->index++];
+          if(!already_picked(picker, candidate, true)) {
+            *move = candidate;
+            return true;
+          }
+        }
+        picker->index = picker->bad_captures;
+        picker->stage = PICK_BAD_CAPTURES;
+        break;
+      case PICK_BAD_CAPTURES:
+        while(picker->index < picker->tactical) {
+          pick_best(picker, picker->index, picker->tactical);
+          Move candidate = moves->moves[picker->index++];
+          if(!already_picked(picker, candidate, false)) {
+            *move = candidate;
+            return true;
+          }
+        }
+        picker->stage = PICK_DONE;
+        break;
+      case PICK_DONE:
+        return false;
+    }
+  }
+}
+
+// Rewards a quiet move that caused a cutoff.
+void update_quiet_stats(SearchThread* thread, int ply, int depth, Move move) {
+  if(!move_equal(move, thread->killers[ply][0])) {
+    thread->killers[ply][1] = thread->killers[ply][0];
+    thread->killers[ply][0] = move;
+  }
+  int* history = &thread->history[thread->board.move][square_index(move.from)][square_index(move.to)];
+  *history += depth * depth;
+  if(*history >= HISTORY_LIMIT) {
+    int* entries = &thread->history[0][0][0];
+    for(int i=0; i<sizeof(thread->history) / sizeof(int); i++) {
+      entries[i] /= 2;
+    }
+  }
 }
 
-void update_table(HashTable* table, const Board* board, int score, int depth) {
+void update_table(HashTable* table, const Board* board, int ply, int score, int depth, int alpha, int beta, Move move) {
   if(table != NULL) {
     if(depth > 0) {
-      insert_hashtable(table, board, score, depth);
+      enum Bound bound = BOUND_EXACT;
+      if(score <= alpha) {
+        bound = BOUND_UPPER;
+      } else if(score >= beta) {
+        bound = BOUND_LOWER;
+      }
+      insert_hashtable(table, board, score_to_table(score, ply), depth, bound, move);
     }
   }
 }
 
-int minimax_score(HashTable* table, const Board* board, int max_depth, int alpha, int beta, Move* best_move) {
+int minimax_node(SearchThread* thread, int ply, int max_depth, int alpha, int beta, bool on_pv) {
   Move nullmove = {{0,0},{0,0}};
+  Move hash_move = nullmove;
+  HashTable* table = thread->table;
+  Board* board = &thread->board;
+
+  thread->pv_length[ply] = ply;
+  if(search_stopped(thread)) {
+    return 0; // Discarded by the caller.
+  }
+  if(++thread->nodes % LIMIT_CHECK_INTERVAL == 0) {
+    check_limits(thread);
+  }
 
   if(table != NULL) {
-    Entry* entry = lookup_hashtable(table, board);
-    // Make sure the depth of the cached entry is at least as much as our current search.
-    if(entry != NULL && max_depth <= entry->depth) {
-      return entry->score;
+    Entry entry;
+    thread->tt_probes++;
+    if(lookup_hashtable(table, board, &entry)) {
+      thread->tt_hits++;
+      hash_move = entry.move;
+      entry.score = score_from_table(entry.score, ply);
+      // Make sure the depth of the cached entry is at least as much as our
+      // current search, and that its bound is enough for a cutoff. The root
+      // always searches, since it has to produce a move.
+      if(ply > 0 && max_depth <= entry.depth) {
+        if(entry.bound == BOUND_EXACT
+           || (entry.bound == BOUND_LOWER && entry.score >= beta)
+           || (entry.bound == BOUND_UPPER && entry.score <= alpha)) {
+          STAT(thread, tt_cutoffs);
+          return entry.score;
+        }
+      }
+    }
+  }
+
+  if(ply > 0 && search_options.bitbases) {
+    // Only positions of three pieces or fewer are worth a probe.
+    Bitboard rest = occupancy(board);
+    rest &= rest - 1;
+    rest &= rest - 1;
+    rest &= rest - 1;
+    enum Color strong;
+    bool win;
+    if(!rest && probe_bitbase(search_options.bitbases, board, &strong, &win)) {
+      Bitboard piece = occupancy(board) & ~board->pieces[KING];
+      if(!win || board->squares[lsb(piece)].piece != thread->control->bitbase_piece) {
+        return bitbase_score(board, strong, win);
+      }
     }
   }
 
   //printf("Searching, with depth %d\n", max_depth);
   //print_board(board);
   int my_score = score(board); // Default score is our heuristic function.
-  if(my_score > CHECKMATE_SCORE_THRESHOLD || my_score < -CHECKMATE_SCORE_THRESHOLD) {
-    // TODO maybe cache leaf nodes?
+  STAT(thread, evaluations);
+  if(ply >= MAX_PLY - 1) {
     return my_score;
   }
 
+  SearchNode node;
+  node.ply = ply;
+  node.max_depth = max_depth;
+  node.alphabeta[WHITE] = alpha;
+  node.alphabeta[BLACK] = beta;
+  node.best_move = nullmove;
+  node.on_pv = on_pv;
+
+  node.stand_pat = my_score;
+  node.searched = 0;
+  node.check = in_check(board);
+  bool quiescence = node.max_depth <= 0 && !node.check;
+  if(quiescence) {
+    search_stand_pat(board, &node, my_score);
+  }
+  thread->stack[ply].null_move = false;
+  if(search_options.null_move && try_null_move(thread, &node)) {
+    STAT(thread, null_move_cutoffs);
+    int bound = node.alphabeta[enemy_color(board->move)];
+    update_table(table, board, ply, bound, max_depth, alpha, beta, hash_move);
+    return bound;
+  }
 
-  SearchCallbackData data;
-  data.table = table;
-  data.max_depth = max_depth;
-  data.alphabeta[WHITE] = alpha;
-  data.alphabeta[BLACK] = beta;
-  data.best_move = best_move;
+  // Follow the previous iteration's principal variation, then try the move
+  // stored in the table; they're the most likely cutoffs.
+  Move pv_move = node.on_pv ? thread->pv_seed[ply] : nullmove;
+  MovePicker picker;
+  init_move_picker(&picker, thread, ply, pv_move, hash_move, quiescence);
+  Move move;
+  while(next_move(&picker, thread, &move)) {
+    if(node.alphabeta[WHITE] >= node.alphabeta[BLACK]) {
+      break;
+    }
+    int reduction = 0;
+    if(search_options.late_move_reductions && picker.stage == PICK_QUIETS && !node.check) {
+      reduction = late_move_reduction(node.max_depth, node.searched);
+      if(reduction > 0) {
+        STAT(thread, lmr_reductions);
+      }
+    }
+    search_move(thread, &node, move, reduction);
+    if(node.alphabeta[WHITE] >= node.alphabeta[BLACK]) {
+      STAT(thread, fail_highs);
+      if(node.searched == 1) {
+        STAT(thread, fail_high_first);
+      }
+      if(node.max_depth > 0 && move_equal(move, node.best_move) && !is_tactical(board, move)) {
+        update_quiet_stats(thread, ply, node.max_depth, move);
+      }
+    }
+  }
+  if(search_stopped(thread)) {
+    return 0;
+  }
 
-  if(data.max_depth <= 0) {
-    search_stand_pat(board, &data, my_score);
+  int score = node.alphabeta[board->move];
+  if(node.searched == 0 && !quiescence) {
+    // No legal moves: mate if in check, otherwise stalemate.
+    int valence = board->move == WHITE ? 1 : -1;
+    score = node.check ? -valence * (CHECKMATE_SCORE - ply) : 0;
   }
-  valid_moves_sorted(board, move_order_comparator, search_callback, &data);
-  if(data.alphabeta[WHITE] == alpha && data.alphabeta[BLACK] == beta) {
-    int score = data.alphabeta[board->move];
-    update_table(table, board, score, max_depth);
-    return score;
+#ifdef SEARCH_STATS
+  if(quiescence) {
+    thread->stats.quiescence_nodes++;
+  } else if(beta - alpha > 1) {
+    thread->stats.pv_nodes++;
+  } else if((board->move == WHITE && score >= beta) || (board->move == BLACK && score <= alpha)) {
+    thread->stats.cut_nodes++;
+  } else {
+    thread->stats.all_nodes++;
   }
+#endif
+  update_table(table, board, ply, score, max_depth, alpha, beta, node.best_move);
+  return score;
+}
 
-  int score = data.alphabeta[board->move];
-  update_table(table, board, score, max_depth);
+void init_search_thread(SearchThread* thread, int id, HashTable* table, SearchControl* control) {
+  thread->id = id;
+  thread->table = table;
+  thread->control = control;
+  thread->pv_seed = NULL;
+  thread->nodes = 0;
+  thread->tt_probes = 0;
+  thread->tt_hits = 0;
+#ifdef SEARCH_STATS
+  memset(&thread->stats, 0, sizeof(thread->stats));
+#endif
+  memset(thread->killers, 0, sizeof(thread->killers));
+  memset(thread->history, 0, sizeof(thread->history));
+}
+
+int minimax_score(SearchThread* thread, const Board* board, int max_depth, int alpha, int beta, Move* best_move) {
+  thread->board = *board;
+  int score = minimax_node(thread, 0, max_depth, alpha, beta, thread->pv_seed != NULL);
+  int length = thread->pv_length[0];
+  memcpy(best_move, thread->pv[0], sizeof(Move) * length);
+  memset(best_move + length, 0, sizeof(Move) * (MAX_PLY - length));
   return score;
 }
+
+uint64_t time_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Milliseconds to spend on this move, or 0 to search without a deadline.
+uint64_t time_budget(const SearchLimits* limits, enum Color side) {
+  if(limits->movetime) {
+    return limits->movetime;
+  }
+  if(limits->time[side]) {
+    // Assume 30 more moves unless told otherwise, and keep a margin so we
+    // never flag.
+    int moves = limits->moves_to_go > 0 && limits->moves_to_go < 30 ? limits->moves_to_go + 1 : 30;
+    int64_t budget = limits->time[side] / moves + limits->increment[side] * 3 / 4;
+    int64_t most = limits->time[side] - 50;
+    if(budget > most) {
+      budget = most;
+    }
+    return budget > 1 ? budget : 1;
+  }
+  return 0;
+}
+
+typedef struct HelperThread {
+  SearchThread thread;
+  const Board* board;
+  Move pv[MAX_PLY];
+  pthread_t handle;
+} HelperThread;
+
+void* helper_search(void* arg) {
+  HelperThread* helper = (HelperThread*)arg;
+  Move best_moves[MAX_PLY];
+  // Odd helpers start one ply ahead, so helpers spread over two depths at a
+  // time and fill the table ahead of the main thread.
+  for(int depth = 1 + helper->thread.id % 2; depth <= MAX_SEARCH_DEPTH; depth++) {
+    minimax_score(&helper->thread, helper->board, depth, WORST_POSSIBLE_SCORE, BEST_POSSIBLE_SCORE, best_moves);
+    if(search_stopped(&helper->thread)) {
+      break;
+    }
+    memcpy(helper->pv, best_moves, sizeof(best_moves));
+  }
+  return NULL;
+}
+
+SearchResult parallel_search(HashTable* table, const Board* board, const SearchLimits* limits, int threads, Move* best_moves, IterationCallback* callback, void* callback_data) {
+  SearchControl control;
+  atomic_init(&control.stop, false);
+  atomic_init(&control.nodes, 0);
+  control.start = time_ms();
+  uint64_t budget = time_budget(limits, board->move);
+  control.deadline = budget ? control.start + budget : 0;
+  control.soft_deadline = budget ? control.start + budget / 2 : 0;
+  control.node_limit = limits->nodes;
+  control.external_stop = limits->stop;
+  control.completed_depth = 0;
+  Bitboard pieces = occupancy(board) & ~board->pieces[KING];
+  control.bitbase_piece = pieces && !(pieces & (pieces - 1)) ? board->squares[lsb(pieces)].piece : EMPTY;
+
+  if(threads < 1) {
+    threads = 1;
+  }
+  HelperThread* helpers = calloc(threads, sizeof(HelperThread));
+  for(int i=0; i<threads; i++) {
+    init_search_thread(&helpers[i].thread, i, table, &control);
+    helpers[i].thread.pv_seed = helpers[i].pv;
+    helpers[i].board = board;
+  }
+  for(int i=1; i<threads; i++) {
+    pthread_create(&helpers[i].handle, NULL, helper_search, &helpers[i]);
+  }
+
+  SearchResult result = {0};
+  SearchThread* main_thread = &helpers[0].thread;
+  Move pv[MAX_PLY];
+  memset(best_moves, 0, sizeof(Move) * MAX_PLY);
+  main_thread->pv_seed = best_moves;
+  int max_depth = limits->depth > 0 && limits->depth < MAX_SEARCH_DEPTH ? limits->depth : MAX_SEARCH_DEPTH;
+  for(int depth=1; depth<=max_depth; depth++) {
+    // Aspiration window: expect about the last iteration's score, widening
+    // the side that fails until the score lands inside.
+    int alpha = WORST_POSSIBLE_SCORE;
+    int beta = BEST_POSSIBLE_SCORE;
+    int delta = ASPIRATION_WINDOW;
+    if(depth >= ASPIRATION_MIN_DEPTH && !score_is_checkmate(result.score)) {
+      alpha = result.score - delta;
+      beta = result.score + delta;
+    }
+    int score;
+    while(true) {
+      score = minimax_score(main_thread, board, depth, alpha, beta, pv);
+      if(search_stopped(main_thread)) {
+        break;
+      }
+      delta *= 2;
+      if(score <= alpha && alpha > WORST_POSSIBLE_SCORE) {
+        alpha = delta > ASPIRATION_MAX_WINDOW ? WORST_POSSIBLE_SCORE : score - delta;
+      } else if(score >= beta && beta < BEST_POSSIBLE_SCORE) {
+        beta = delta > ASPIRATION_MAX_WINDOW ? BEST_POSSIBLE_SCORE : score + delta;
+      } else {
+        break;
+      }
+    }
+    if(search_stopped(main_thread)) {
+      break;
+    }
+    memcpy(best_moves, pv, sizeof(pv));
+    control.completed_depth = depth;
+    result.score = score;
+    result.depth = depth;
+    result.time = time_ms() - control.start;
+    result.nodes = atomic_load(&control.nodes) + main_thread->nodes % LIMIT_CHECK_INTERVAL;
+#ifdef SEARCH_STATS
+    main_thread->stats.iteration_nodes[depth] = main_thread->nodes;
+    main_thread->stats.iteration_time[depth] = result.time;
+#endif
+    if(callback != NULL) {
+      callback(board, &result, best_moves, callback_data);
+    }
+    // An iteration takes longer than everything before it, so don't start one
+    // that won't finish.
+    if((control.soft_deadline && time_ms() >= control.soft_deadline)
+       || (control.node_limit && result.nodes >= control.node_limit)
+       || (control.external_stop && atomic_load(control.external_stop))) {
+      break;
+    }
+  }
+
+  atomic_store(&control.stop, true);
+  result.nodes = 0;
+  for(int i=0; i<threads; i++) {
+    if(i > 0) {
+      pthread_join(helpers[i].handle, NULL);
+    }
+    result.nodes += helpers[i].thread.nodes;
+    result.tt_probes += helpers[i].thread.tt_probes;
+    result.tt_hits += helpers[i].thread.tt_hits;
+#ifdef SEARCH_STATS
+    merge_search_stats(&result.stats, &helpers[i].thread.stats);
+#endif
+  }
+  result.time = time_ms() - control.start;
+#ifdef SEARCH_STATS
+  memcpy(result.stats.iteration_nodes, main_thread->stats.iteration_nodes, sizeof(result.stats.iteration_nodes));
+  memcpy(result.stats.iteration_time, main_thread->stats.iteration_time, sizeof(result.stats.iteration_time));
+  if(search_stats_output) {
+    write_search_stats(search_stats_output, &result.stats, result.depth, result.score, result.nodes,
+                       result.time, result.tt_probes, result.tt_hits);
+  }
+#endif
+  free(helpers);
+  return result;
+}
@@ -17,10 +17,160 @@ limitations under the License.
 #define AI_H
 
 #include "grubchess.h"
+#include "bitbase.h"
 #include "hashtable.h"
+#include "stats.h"
+
+#include <stdatomic.h>
 
 #define WORST_POSSIBLE_SCORE -1000000
 #define BEST_POSSIBLE_SCORE 1000000
-int minimax_score(HashTable* table, const Board* board, int max_depth, int alpha, int beta, Move* best_move);
+// Deepest iteration a search will start; quiescence may go further.
+#define MAX_SEARCH_DEPTH 64
+_Static_assert(STATS_ITERATIONS == MAX_SEARCH_DEPTH + 1, "one stats slot per iteration");
+// Deepest a search goes, quiescence included. Also the length of a PV.
+#define MAX_PLY 128
+// Root window around the previous iteration's score, from this depth on.
+// It doubles on every failure, and opens fully past the maximum.
+#define ASPIRATION_WINDOW 30
+#define ASPIRATION_MIN_DEPTH 4
+#define ASPIRATION_MAX_WINDOW 500
+// Plies taken off a null move search, one more from depth 7.
+#define NULL_MOVE_REDUCTION 2
+#define NULL_MOVE_MIN_DEPTH 3
+// Quiet moves from the LMR_MIN_MOVES-th on are reduced from this depth.
+#define LMR_MIN_DEPTH 3
+#define LMR_MIN_MOVES 3
+// Nodes between checks of the time and node limits.
+#define LIMIT_CHECK_INTERVAL 1024
+
+// Material plus piece-square score of a piece on a square, from white's
+// point of view. Board.material keeps the running sum over the board.
+extern int PIECE_SQUARE_SCORES[NUM_COLORS][NUM_PIECES][BOARD_WIDTH * BOARD_WIDTH];
+void init_evaluation();
+// Full rescan, to check the incremental total against.
+int compute_material(const Board* board);
+// Static exchange evaluation: what a capture wins once the recaptures on
+// its square are played out.
+int see(const Board* board, Move move);
+
+// Selectivity switches, so each can be compared against plain alpha-beta.
+typedef struct SearchOptions {
+  bool null_move;
+  bool late_move_reductions;
+  const Bitbases* bitbases; // Probed below the root, or NULL.
+} SearchOptions;
+extern SearchOptions search_options;
+
+// Zero means no limit. With no limits at all, the search runs to
+// MAX_SEARCH_DEPTH or until stopped.
+typedef struct SearchLimits {
+  int depth;
+  uint64_t nodes;
+  int movetime; // ms
+  // Remaining clock time and increment per move, in ms.
+  int time[NUM_COLORS];
+  int increment[NUM_COLORS];
+  int moves_to_go; // Moves until the clock is topped up, 0 if unknown.
+  // Set from another thread to end the search early, or NULL.
+  atomic_bool* stop;
+} SearchLimits;
+
+// Shared between all threads of one search.
+typedef struct SearchControl {
+  atomic_bool stop;
+  atomic_uint_fast64_t nodes;
+  uint64_t start;
+  uint64_t deadline; // Time to abort at, 0 for none.
+  uint64_t soft_deadline; // Don't start another iteration after this.
+  uint64_t node_limit;
+  atomic_bool* external_stop;
+  int completed_depth;
+  // The root's piece besides the kings, if it's already a bitbase ending.
+  // Bitbase wins with it are left to the search, which needs to find the
+  // mate; only wins reached by captures or promotions are cut.
+  enum Piece bitbase_piece;
+} SearchControl;
+
+// One ply of the preallocated search stack.
+typedef struct SearchStack {
+  MoveList moves;
+  int scores[MAX_MOVES]; // Ordering scores for moves, filled stage by stage.
+  Undo undo;
+  bool null_move; // Whether the move made at this ply passed the turn.
+} SearchStack;
+
+// History scores are halved once one reaches this.
+#define HISTORY_LIMIT (1 << 20)
+
+// Per-thread search state. Everything but the table and the control block is
+// private to the thread.
+typedef struct SearchThread {
+  int id;
+  HashTable* table;
+  SearchControl* control;
+  // Principal variation of the previous iteration, searched first.
+  const Move* pv_seed;
+  uint64_t nodes;
+  uint64_t tt_probes;
+  uint64_t tt_hits;
+#ifdef SEARCH_STATS
+  SearchStats stats;
+#endif
+
+  // The position being searched, made and unmade in place.
+  Board board;
+  SearchStack stack[MAX_PLY];
+  // Triangular PV table: the best line found from ply is
+  // pv[ply][ply] .. pv[ply][pv_length[ply]-1].
+  Move pv[MAX_PLY][MAX_PLY];
+  int pv_length[MAX_PLY];
+
+  // Quiet moves that caused a cutoff at each ply, most recent first.
+  Move killers[MAX_PLY][2];
+  // How often a quiet move caused a cutoff, weighted by depth squared.
+  int history[NUM_COLORS][BOARD_WIDTH*BOARD_WIDTH][BOARD_WIDTH*BOARD_WIDTH];
+} SearchThread;
+
+typedef struct SearchResult {
+  int score;
+  int depth;
+  uint64_t nodes;
+  uint64_t time; // ms
+  uint64_t tt_probes;
+  uint64_t tt_hits;
+#ifdef SEARCH_STATS
+  SearchStats stats; // Summed over all threads.
+#endif
+} SearchResult;
+
+// Called after every completed iteration with its principal variation.
+typedef void IterationCallback(const Board* board, const SearchResult* result, const Move* pv, void* data);
+
+uint64_t time_ms();
+// Milliseconds to spend on this move, or 0 to search without a deadline.
+uint64_t time_budget(const SearchLimits* limits, enum Color side);
+
+// Size of a mate score at the root, one less for every ply to the mate.
+extern const int CHECKMATE_SCORE;
+// Whether a score means a forced checkmate.
+bool score_is_checkmate(int score);
+// Plies from the root to the mate a checkmate score stands for.
+int checkmate_plies(int score);
+// Converts mate scores between counting from the root and counting from a
+// node ply plies below it.
+int score_to_table(int score, int ply);
+int score_from_table(int score, int ply);
+
+void init_search_thread(SearchThread* thread, int id, HashTable* table, SearchControl* control);
+// Searches board, leaving its principal variation in best_move, MAX_PLY long
+// and terminated by a null move.
+int minimax_score(SearchThread* thread, const Board* board, int max_depth, int alpha, int beta, Move* best_move);
+
+// Iterative deepening within limits. With Lazy SMP, threads-1 helpers search
+// the same root at staggered depths, sharing the table. If the limits cut an
+// iteration short, its results are dropped: best_moves (MAX_PLY long) holds
+// the principal variation of the last completed iteration.
+SearchResult parallel_search(HashTable* table, const Board* board, const SearchLimits* limits, int threads, Move* best_moves, IterationCallback* callback, void* callback_data);
 
 #endif
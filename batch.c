@@ -0,0 +1,193 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grubchess.h"
+#include "ai.h"
+#include "batch.h"
+#include "hashtable.h"
+
+// Positions may be read this far ahead of the oldest one not yet written.
+#define BATCH_WINDOW 1024
+#define BATCH_LINE_LENGTH 1024
+
+typedef struct BatchSlot {
+  char line[BATCH_LINE_LENGTH];
+  bool done;
+  bool valid;
+  Board board;
+  SearchResult result;
+  Move best_move;
+} BatchSlot;
+
+// Slots form a ring indexed by position number. The reader fills slots up to
+// read, workers claim them in order and the writer drains finished slots
+// from written, so output keeps the input order.
+typedef struct BatchQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  BatchSlot* slots;
+  uint64_t read;
+  uint64_t claimed;
+  uint64_t written;
+  bool eof;
+  const SearchLimits* limits;
+} BatchQueue;
+
+void analyze_slot(BatchSlot* slot, HashTable* table, const SearchLimits* limits) {
+  slot->valid = parse_fen(&slot->board, slot->line);
+  if(!slot->valid) {
+    return;
+  }
+  Move best_moves[MAX_PLY];
+  clear_hashtable(table);
+  slot->result = parallel_search(table, &slot->board, limits, 1, best_moves, NULL, NULL);
+  slot->best_move = best_moves[0];
+}
+
+void* batch_worker(void* data) {
+  BatchQueue* queue = (BatchQueue*) data;
+  HashTable table;
+  init_hashtable(&table, BATCH_HASH_MB);
+  pthread_mutex_lock(&queue->lock);
+  while(true) {
+    while(queue->claimed == queue->read && !queue->eof) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if(queue->claimed == queue->read) {
+      break;
+    }
+    BatchSlot* slot = &queue->slots[queue->claimed++ % BATCH_WINDOW];
+    pthread_mutex_unlock(&queue->lock);
+    analyze_slot(slot, &table, queue->limits);
+    pthread_mutex_lock(&queue->lock);
+    slot->done = true;
+    pthread_cond_broadcast(&queue->changed);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  free_hashtable(&table);
+  return NULL;
+}
+
+void write_slot(FILE* output, uint64_t index, const BatchSlot* slot) {
+  // Echo the four position fields, which never need JSON escaping.
+  char fen[BATCH_LINE_LENGTH] = "";
+  const char* field = slot->line;
+  for(int i=0; i<4 && *field; i++) {
+    int length = strcspn(field, " \t");
+    strncat(fen, field, length);
+    field += length;
+    field += strspn(field, " \t");
+    if(i < 3 && *field) {
+      strcat(fen, " ");
+    }
+  }
+  for(char* c = fen; *c; c++) {
+    if(*c == '"' || *c == '\\' || (unsigned char)*c < ' ') {
+      *c = '?';
+    }
+  }
+  if(!slot->valid) {
+    fprintf(output, "{\"index\": %llu, \"fen\": \"%s\", \"error\": \"invalid position\"}\n",
+            (unsigned long long)index, fen);
+    return;
+  }
+  char move[6] = "0000";
+  if(pack_move(slot->best_move) != 0) {
+    format_move(&slot->board, slot->best_move, move);
+  }
+  int valence = slot->board.move == WHITE ? 1 : -1;
+  fprintf(output, "{\"index\": %llu, \"fen\": \"%s\", \"bestmove\": \"%s\", \"score\": %d, "
+          "\"depth\": %d, \"nodes\": %llu, \"time_ms\": %llu}\n",
+          (unsigned long long)index, fen, move, slot->result.score * valence, slot->result.depth,
+          (unsigned long long)slot->result.nodes, (unsigned long long)slot->result.time);
+}
+
+uint64_t batch_analyze(FILE* input, FILE* output, const SearchLimits* limits, int workers) {
+  BatchQueue queue;
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+  queue.slots = calloc(BATCH_WINDOW, sizeof(BatchSlot));
+  queue.read = 0;
+  queue.claimed = 0;
+  queue.written = 0;
+  queue.eof = false;
+  queue.limits = limits;
+  if(workers < 1) {
+    workers = 1;
+  }
+  pthread_t* handles = calloc(workers, sizeof(pthread_t));
+  for(int i=0; i<workers; i++) {
+    pthread_create(&handles[i], NULL, batch_worker, &queue);
+  }
+
+  pthread_mutex_lock(&queue.lock);
+  while(true) {
+    // Write out whatever finished, oldest first.
+    BatchSlot* oldest = &queue.slots[queue.written % BATCH_WINDOW];
+    if(queue.written < queue.read && oldest->done) {
+      pthread_mutex_unlock(&queue.lock);
+      write_slot(output, queue.written, oldest);
+      pthread_mutex_lock(&queue.lock);
+      queue.written++;
+      continue;
+    }
+    if(queue.eof && queue.written == queue.read) {
+      break;
+    }
+    if(queue.eof || queue.read - queue.written == BATCH_WINDOW) {
+      pthread_cond_wait(&queue.changed, &queue.lock);
+      continue;
+    }
+
+    // Nobody else touches the slot past read, so fill it unlocked.
+    BatchSlot* slot = &queue.slots[queue.read % BATCH_WINDOW];
+    pthread_mutex_unlock(&queue.lock);
+    bool got_line = false;
+    while(fgets(slot->line, sizeof(slot->line), input)) {
+      slot->line[strcspn(slot->line, "\r\n")] = '\0';
+      char* start = slot->line + strspn(slot->line, " \t");
+      if(*start && *start != '#') {
+        memmove(slot->line, start, strlen(start) + 1);
+        got_line = true;
+        break;
+      }
+    }
+    slot->done = false;
+    pthread_mutex_lock(&queue.lock);
+    if(got_line) {
+      queue.read++;
+    } else {
+      queue.eof = true;
+    }
+    pthread_cond_broadcast(&queue.changed);
+  }
+  pthread_mutex_unlock(&queue.lock);
+
+  for(int i=0; i<workers; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  free(handles);
+  free(queue.slots);
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.lock);
+  return queue.written;
+}
@@ -0,0 +1,32 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "ai.h"
+
+// Table size for each worker; tables are cleared before every position so
+// results don't depend on which worker searched what before.
+#define BATCH_HASH_MB 16
+
+// Analyzes every FEN or EPD line of input within limits, spread over a pool
+// of workers with a table each. Writes one JSON object per position to
+// output, in input order. Returns the number of positions analyzed.
+uint64_t batch_analyze(FILE* input, FILE* output, const SearchLimits* limits, int workers);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "grubchess.h"
+#include "ai.h"
+#include "bitbase.h"
+#include "bitboard.h"
+#include "hashtable.h"
+
+const enum Piece BITBASE_PIECES[NUM_BITBASES] = {QUEEN, ROOK, PAWN};
+const char* BITBASE_NAMES[NUM_BITBASES] = {"KQK", "KRK", "KPK"};
+
+// Positions of one side to move, decided per pass.
+#define SIDE_POSITIONS (BITBASE_POSITIONS / NUM_COLORS)
+// Indices a thread takes at a time.
+#define BITBASE_CHUNK 4096
+
+enum BitbaseResult {
+  RESULT_UNKNOWN = 0, // Not a win yet; a draw once generation ends.
+  RESULT_WIN,
+  RESULT_ILLEGAL
+};
+
+static inline int bitbase_index(enum Color move, int strong_king, int weak_king, int piece) {
+  return ((move * 64 + strong_king) * 64 + weak_king) * 64 + piece;
+}
+
+int bitbase_set(enum Piece piece) {
+  for(int set=0; set<NUM_BITBASES; set++) {
+    if(BITBASE_PIECES[set] == piece) {
+      return set;
+    }
+  }
+  return -1;
+}
+
+// Sets up the position at index, with white as the strong side. Returns
+// false if it can't happen in a game.
+bool bitbase_board(Board* board, enum Piece piece, int index) {
+  enum Color move = index / SIDE_POSITIONS;
+  int strong_king = index >> 12 & 63;
+  int weak_king = index >> 6 & 63;
+  int square = index & 63;
+  if(strong_king == weak_king || strong_king == square || weak_king == square
+     || (KING_ATTACKS[strong_king] & square_bit(weak_king))
+     || (piece == PAWN && (square < BOARD_WIDTH || square >= NUM_SQUARES - BOARD_WIDTH))) {
+    return false;
+  }
+  memset(board, 0, sizeof(Board));
+  for(int i=0; i<NUM_SQUARES; i++) {
+    board->squares[i] = (Square) {EMPTY, BLACK};
+  }
+  board->en_passant = -1;
+  set_square(board, index_position(strong_king), (Square) {KING, WHITE});
+  set_square(board, index_position(weak_king), (Square) {KING, BLACK});
+  set_square(board, index_position(square), (Square) {piece, WHITE});
+  board->move = move;
+  board->hash ^= hash_state(board);
+  // The side that just moved can't have left its king in check.
+  enum Color other = enemy_color(move);
+  return !square_attacked(board, lsb(pieces_of(board, KING, other)), move);
+}
+
+typedef struct BitbaseGenerator {
+  uint8_t* results[NUM_BITBASES];
+  int set;
+  enum Color move; // Side to move in the positions being decided.
+  atomic_int next;
+  atomic_int changed;
+} BitbaseGenerator;
+
+// Looks up the position reached by a move in the tables built so far. A
+// capture leaves bare kings, which draw.
+enum BitbaseResult child_result(const BitbaseGenerator* generator, const Board* board) {
+  Bitboard pieces = occupancy(board) & ~board->pieces[KING];
+  if(!pieces) {
+    return RESULT_UNKNOWN;
+  }
+  int square = lsb(pieces);
+  int set = bitbase_set(board->squares[square].piece);
+  int index = bitbase_index(board->move, lsb(pieces_of(board, KING, WHITE)),
+                            lsb(pieces_of(board, KING, BLACK)), square);
+  return generator->results[set][index];
+}
+
+// The strong side wins if some move reaches a win, trying a rook where a
+// queen would stalemate. The weak side loses if mated, or if every move
+// reaches a win.
+bool decide_position(BitbaseGenerator* generator, int index) {
+  uint8_t* results = generator->results[generator->set];
+  if(results[index] != RESULT_UNKNOWN) {
+    return false;
+  }
+  Board board;
+  if(!bitbase_board(&board, BITBASE_PIECES[generator->set], index)) {
+    results[index] = RESULT_ILLEGAL;
+    return false;
+  }
+  MoveList moves;
+  generate_moves(&board, &moves);
+  if(board.move == WHITE) {
+    for(int i=0; i<moves.count; i++) {
+      Move move = moves.moves[i];
+      bool promotion = is_promotion(&board, move);
+      Undo undo;
+      make_move(&board, move, &undo);
+      enum BitbaseResult result = child_result(generator, &board);
+      if(promotion && result != RESULT_WIN) {
+        set_square(&board, move.to, (Square) {ROOK, WHITE});
+        result = child_result(generator, &board);
+      }
+      unmake_move(&board, move, &undo);
+      if(result == RESULT_WIN) {
+        results[index] = RESULT_WIN;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if(moves.count == 0) {
+    if(in_check(&board)) {
+      results[index] = RESULT_WIN;
+      return true;
+    }
+    return false; // Stalemate.
+  }
+  for(int i=0; i<moves.count; i++) {
+    Undo undo;
+    make_move(&board, moves.moves[i], &undo);
+    enum BitbaseResult result = child_result(generator, &board);
+    unmake_move(&board, moves.moves[i], &undo);
+    if(result != RESULT_WIN) {
+      return false;
+    }
+  }
+  results[index] = RESULT_WIN;
+  return true;
+}
+
+// Positions of one side only read the other side's results, so threads can
+// decide them in any order without locks.
+void* bitbase_worker(void* data) {
+  BitbaseGenerator* generator = (BitbaseGenerator*) data;
+  int base = generator->move * SIDE_POSITIONS;
+  int start;
+  while((start = atomic_fetch_add(&generator->next, BITBASE_CHUNK)) < SIDE_POSITIONS) {
+    int changed = 0;
+    for(int i=start; i<start+BITBASE_CHUNK; i++) {
+      changed += decide_position(generator, base + i);
+    }
+    atomic_fetch_add(&generator->changed, changed);
+  }
+  return NULL;
+}
+
+int bitbase_pass(BitbaseGenerator* generator, enum Color move, int threads) {
+  generator->move = move;
+  atomic_store(&generator->next, 0);
+  atomic_store(&generator->changed, 0);
+  pthread_t* handles = calloc(threads, sizeof(pthread_t));
+  for(int i=1; i<threads; i++) {
+    pthread_create(&handles[i], NULL, bitbase_worker, generator);
+  }
+  bitbase_worker(generator);
+  for(int i=1; i<threads; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  free(handles);
+  return atomic_load(&generator->changed);
+}
+
+bool write_bitbase(const char* dir, int set, const uint8_t* results) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s.bb", dir, BITBASE_NAMES[set]);
+  uint8_t* bits = calloc(BITBASE_BYTES, 1);
+  for(int i=0; i<BITBASE_POSITIONS; i++) {
+    if(results[i] == RESULT_WIN) {
+      bits[i >> 3] |= 1 << (i & 7);
+    }
+  }
+  FILE* out = fopen(path, "wb");
+  bool written = out && fwrite(bits, BITBASE_BYTES, 1, out) == 1;
+  if(out) {
+    written = fclose(out) == 0 && written;
+  }
+  free(bits);
+  return written;
+}
+
+bool generate_bitbases(const char* dir, int threads) {
+  if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return false;
+  }
+  if(threads < 1) {
+    threads = 1;
+  }
+  BitbaseGenerator generator;
+  bool written = true;
+  // KPK looks up promotions in KQK and KRK, so those come first.
+  for(int set=0; set<NUM_BITBASES; set++) {
+    generator.results[set] = calloc(BITBASE_POSITIONS, 1);
+    generator.set = set;
+    uint64_t start = time_ms();
+    int passes = 0;
+    int changed;
+    do {
+      changed = bitbase_pass(&generator, BLACK, threads);
+      changed += bitbase_pass(&generator, WHITE, threads);
+      passes++;
+    } while(changed);
+
+    int wins = 0;
+    int legal = 0;
+    for(int i=0; i<BITBASE_POSITIONS; i++) {
+      wins += generator.results[set][i] == RESULT_WIN;
+      legal += generator.results[set][i] != RESULT_ILLEGAL;
+    }
+    printf("%s: %d of %d legal positions won, %d passes, %llu ms\n", BITBASE_NAMES[set],
+           wins, legal, passes, (unsigned long long)(time_ms() - start));
+    written = write_bitbase(dir, set, generator.results[set]) && written;
+  }
+  for(int set=0; set<NUM_BITBASES; set++) {
+    free(generator.results[set]);
+  }
+  return written;
+}
+
+bool open_bitbases(Bitbases* bitbases, const char* dir) {
+  bool found = false;
+  for(int set=0; set<NUM_BITBASES; set++) {
+    bitbases->tables[set] = NULL;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.bb", dir, BITBASE_NAMES[set]);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+      continue;
+    }
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size == BITBASE_BYTES) {
+      void* table = mmap(NULL, BITBASE_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+      if(table != MAP_FAILED) {
+        bitbases->tables[set] = table;
+        found = true;
+      }
+    }
+    close(fd);
+  }
+  return found;
+}
+
+void close_bitbases(Bitbases* bitbases) {
+  for(int set=0; set<NUM_BITBASES; set++) {
+    if(bitbases->tables[set]) {
+      munmap((void*)bitbases->tables[set], BITBASE_BYTES);
+    }
+    bitbases->tables[set] = NULL;
+  }
+}
+
+bool probe_bitbase(const Bitbases* bitbases, const Board* board, enum Color* strong, bool* win) {
+  Bitboard pieces = occupancy(board) & ~board->pieces[KING];
+  if(!pieces || (pieces & (pieces - 1))
+     || !pieces_of(board, KING, WHITE) || !pieces_of(board, KING, BLACK)) {
+    return false;
+  }
+  int square = lsb(pieces);
+  Square piece = board->squares[square];
+  int set = bitbase_set(piece.piece);
+  if(set < 0 || bitbases->tables[set] == NULL) {
+    return false;
+  }
+  int strong_king = lsb(pieces_of(board, KING, piece.color));
+  int weak_king = lsb(pieces_of(board, KING, enemy_color(piece.color)));
+  if(piece.color == BLACK) {
+    // Flip the board so the strong side plays up it as white.
+    strong_king ^= 56;
+    weak_king ^= 56;
+    square ^= 56;
+  }
+  int index = bitbase_index(board->move == piece.color ? WHITE : BLACK, strong_king, weak_king, square);
+  *strong = piece.color;
+  *win = bitbases->tables[set][index >> 3] >> (index & 7) & 1;
+  return true;
+}
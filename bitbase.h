@@ -0,0 +1,56 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef BITBASE_H
+#define BITBASE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "grubchess.h"
+
+// Win/draw bitbases for king and one piece against a bare king, built by
+// retrograde analysis. The lone king can never win, so one bit per position
+// says whether the side with the piece wins with best play.
+enum BitbaseSet {
+  BITBASE_KQK,
+  BITBASE_KRK,
+  BITBASE_KPK,
+  NUM_BITBASES
+};
+
+// Indexed by side to move, strong king, weak king and piece square, with
+// the strong side as white; black's positions are probed mirrored.
+#define BITBASE_POSITIONS (NUM_COLORS * 64 * 64 * 64)
+#define BITBASE_BYTES (BITBASE_POSITIONS / 8)
+
+typedef struct Bitbases {
+  const uint8_t* tables[NUM_BITBASES]; // Mapped files, NULL if missing.
+} Bitbases;
+
+// Builds every bitbase into dir, splitting each pass over threads. Returns
+// false if a file couldn't be written.
+bool generate_bitbases(const char* dir, int threads);
+
+// Maps the bitbases found in dir. Returns false if none were.
+bool open_bitbases(Bitbases* bitbases, const char* dir);
+void close_bitbases(Bitbases* bitbases);
+
+// For a position of two kings and a piece covered by a bitbase, sets
+// strong to the side with the piece and returns true. win tells whether
+// that side wins.
+bool probe_bitbase(const Bitbases* bitbases, const Board* board, enum Color* strong, bool* win);
+
+#endif
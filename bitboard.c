@@ -0,0 +1,219 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include "grubchess.h"
+#include "bitboard.h"
+
+Bitboard KNIGHT_ATTACKS[NUM_SQUARES];
+Bitboard KING_ATTACKS[NUM_SQUARES];
+Bitboard PAWN_ATTACKS[NUM_COLORS][NUM_SQUARES];
+Bitboard BETWEEN[NUM_SQUARES][NUM_SQUARES];
+Bitboard LINE[NUM_SQUARES][NUM_SQUARES];
+
+// "Fancy" magic bitboards: every square owns a slice of a shared attack
+// table, indexed by the relevant blockers multiplied by a magic number.
+// When BMI2 is available the index is computed with PEXT instead.
+typedef struct Magic {
+  Bitboard mask;
+  Bitboard magic;
+  Bitboard* attacks;
+  int shift;
+} Magic;
+
+Magic BISHOP_MAGICS[NUM_SQUARES];
+Magic ROOK_MAGICS[NUM_SQUARES];
+
+// Enough room for every blocker subset of every square.
+Bitboard BISHOP_TABLE[0x1480];
+Bitboard ROOK_TABLE[0x19000];
+
+const int BISHOP_DIRECTIONS[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+const int ROOK_DIRECTIONS[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+
+static inline unsigned magic_index(const Magic* m, Bitboard occupancy) {
+#ifdef __BMI2__
+  return _pext_u64(occupancy, m->mask);
+#else
+  return ((occupancy & m->mask) * m->magic) >> m->shift;
+#endif
+}
+
+Bitboard bishop_attacks(int square, Bitboard occupancy) {
+  const Magic* m = &BISHOP_MAGICS[square];
+  return m->attacks[magic_index(m, occupancy)];
+}
+
+Bitboard rook_attacks(int square, Bitboard occupancy) {
+  const Magic* m = &ROOK_MAGICS[square];
+  return m->attacks[magic_index(m, occupancy)];
+}
+
+Bitboard attackers_to(const Board* board, int square, Bitboard occupied) {
+  return (PAWN_ATTACKS[WHITE][square] & pieces_of(board, PAWN, BLACK))
+    | (PAWN_ATTACKS[BLACK][square] & pieces_of(board, PAWN, WHITE))
+    | (KNIGHT_ATTACKS[square] & board->pieces[KNIGHT])
+    | (KING_ATTACKS[square] & board->pieces[KING])
+    | (bishop_attacks(square, occupied) & (board->pieces[BISHOP] | board->pieces[QUEEN]))
+    | (rook_attacks(square, occupied) & (board->pieces[ROOK] | board->pieces[QUEEN]));
+}
+
+bool square_attacked(const Board* board, int square, enum Color by) {
+  return attackers_to(board, square, occupancy(board)) & board->colors[by];
+}
+
+bool on_board(int rank, int file) {
+  return rank >= 0 && rank < BOARD_WIDTH && file >= 0 && file < BOARD_WIDTH;
+}
+
+// Steps from square by each offset once, used for the leaper tables.
+Bitboard leaper_attacks(int square, const int offsets[][2], int noffsets) {
+  Position pos = index_position(square);
+  Bitboard attacks = 0;
+  for(int i=0; i<noffsets; i++) {
+    int rank = pos.rank + offsets[i][0];
+    int file = pos.file + offsets[i][1];
+    if(on_board(rank, file)) {
+      attacks |= square_bit(rank * BOARD_WIDTH + file);
+    }
+  }
+  return attacks;
+}
+
+// Slow ray walk, only used to fill the magic tables.
+Bitboard slider_attacks(int square, Bitboard occupancy, const int directions[4][2]) {
+  Position pos = index_position(square);
+  Bitboard attacks = 0;
+  for(int d=0; d<4; d++) {
+    for(int i=1; i<BOARD_WIDTH; i++) {
+      int rank = pos.rank + directions[d][0] * i;
+      int file = pos.file + directions[d][1] * i;
+      if(!on_board(rank, file)) {
+        break;
+      }
+      Bitboard bit = square_bit(rank * BOARD_WIDTH + file);
+      attacks |= bit;
+      if(occupancy & bit) {
+        break; // We can't jump over pieces.
+      }
+    }
+  }
+  return attacks;
+}
+
+uint64_t magic_random(uint64_t* state) {
+  // xorshift64*, seeded with a constant so the magics are reproducible.
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+void init_magics(Magic* magics, Bitboard* table, const int directions[4][2]) {
+  Bitboard occupancies[4096];
+  Bitboard references[4096];
+  int epoch[4096] = {0};
+  int current_epoch = 0;
+  uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+  for(int square=0; square<NUM_SQUARES; square++) {
+    Position pos = index_position(square);
+    // Pieces on the board edge never block anything further along the ray.
+    Bitboard edges = ((RANK_1_BB | (RANK_1_BB << 56)) & ~(RANK_1_BB << (8 * pos.rank)))
+      | ((FILE_A_BB | (FILE_A_BB << 7)) & ~(FILE_A_BB << pos.file));
+
+    Magic* m = &magics[square];
+    m->mask = slider_attacks(square, 0, directions) & ~edges;
+    m->shift = 64 - popcount(m->mask);
+    m->attacks = table;
+
+    // Enumerate all subsets of the mask with the Carry-Rippler trick.
+    int size = 0;
+    Bitboard b = 0;
+    do {
+      occupancies[size] = b;
+      references[size] = slider_attacks(square, b, directions);
+      size++;
+      b = (b - m->mask) & m->mask;
+    } while(b);
+
+#ifdef __BMI2__
+    for(int i=0; i<size; i++) {
+      m->attacks[magic_index(m, occupancies[i])] = references[i];
+    }
+#else
+    // Try sparse random numbers until one maps every subset without a
+    // destructive collision.
+    bool found = false;
+    while(!found) {
+      do {
+        m->magic = magic_random(&seed) & magic_random(&seed) & magic_random(&seed);
+      } while(popcount((m->mask * m->magic) >> 56) < 6);
+
+      current_epoch++;
+      found = true;
+      for(int i=0; i<size; i++) {
+        unsigned index = magic_index(m, occupancies[i]);
+        if(epoch[index] < current_epoch) {
+          epoch[index] = current_epoch;
+          m->attacks[index] = references[i];
+        } else if(m->attacks[index] != references[i]) {
+          found = false;
+          break;
+        }
+      }
+    }
+#endif
+    table += size;
+  }
+}
+
+void init_bitboards() {
+  const int knight_offsets[8][2] = {{2, 1}, {2, -1}, {-2, 1}, {-2, -1}, {1, 2}, {1, -2}, {-1, 2}, {-1, -2}};
+  const int king_offsets[8][2] = {{1, 1}, {1, 0}, {1, -1}, {0, 1}, {0, -1}, {-1, 1}, {-1, 0}, {-1, -1}};
+  const int white_pawn_offsets[2][2] = {{1, -1}, {1, 1}};
+  const int black_pawn_offsets[2][2] = {{-1, -1}, {-1, 1}};
+
+  for(int square=0; square<NUM_SQUARES; square++) {
+    KNIGHT_ATTACKS[square] = leaper_attacks(square, knight_offsets, 8);
+    KING_ATTACKS[square] = leaper_attacks(square, king_offsets, 8);
+    PAWN_ATTACKS[WHITE][square] = leaper_attacks(square, white_pawn_offsets, 2);
+    PAWN_ATTACKS[BLACK][square] = leaper_attacks(square, black_pawn_offsets, 2);
+  }
+
+  init_magics(BISHOP_MAGICS, BISHOP_TABLE, BISHOP_DIRECTIONS);
+  init_magics(ROOK_MAGICS, ROOK_TABLE, ROOK_DIRECTIONS);
+
+  for(int from=0; from<NUM_SQUARES; from++) {
+    for(int to=0; to<NUM_SQUARES; to++) {
+      Bitboard ends = square_bit(from) | square_bit(to);
+      if(from == to) {
+        continue;
+      } else if(bishop_attacks(from, 0) & square_bit(to)) {
+        BETWEEN[from][to] = bishop_attacks(from, ends) & bishop_attacks(to, ends);
+        LINE[from][to] = (bishop_attacks(from, 0) & bishop_attacks(to, 0)) | ends;
+      } else if(rook_attacks(from, 0) & square_bit(to)) {
+        BETWEEN[from][to] = rook_attacks(from, ends) & rook_attacks(to, ends);
+        LINE[from][to] = (rook_attacks(from, 0) & rook_attacks(to, 0)) | ends;
+      }
+    }
+  }
+}
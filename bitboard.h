@@ -0,0 +1,86 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef BITBOARD_H
+#define BITBOARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "grubchess.h"
+
+// Squares are indexed rank * BOARD_WIDTH + file, the same as Board.squares,
+// so bit 0 is a1 and bit 63 is h8.
+#define NUM_SQUARES (BOARD_WIDTH * BOARD_WIDTH)
+#define FILE_A_BB 0x0101010101010101ull
+#define RANK_1_BB 0xFFull
+
+extern Bitboard KNIGHT_ATTACKS[NUM_SQUARES];
+extern Bitboard KING_ATTACKS[NUM_SQUARES];
+// Squares a pawn of the given color on the given square captures onto.
+extern Bitboard PAWN_ATTACKS[NUM_COLORS][NUM_SQUARES];
+// For squares on a common rank, file or diagonal: the squares strictly
+// between them, and the whole line through both. Empty otherwise.
+extern Bitboard BETWEEN[NUM_SQUARES][NUM_SQUARES];
+extern Bitboard LINE[NUM_SQUARES][NUM_SQUARES];
+
+void init_bitboards();
+
+Bitboard bishop_attacks(int square, Bitboard occupancy);
+Bitboard rook_attacks(int square, Bitboard occupancy);
+
+static inline Bitboard square_bit(int square) {
+  return 1ull << square;
+}
+
+static inline int square_index(Position position) {
+  return position.rank * BOARD_WIDTH + position.file;
+}
+
+static inline Position index_position(int square) {
+  return (Position) {square / BOARD_WIDTH, square % BOARD_WIDTH};
+}
+
+static inline int lsb(Bitboard b) {
+  return __builtin_ctzll(b);
+}
+
+static inline int pop_lsb(Bitboard* b) {
+  int square = lsb(*b);
+  *b &= *b - 1;
+  return square;
+}
+
+static inline int popcount(Bitboard b) {
+  return __builtin_popcountll(b);
+}
+
+static inline Bitboard queen_attacks(int square, Bitboard occupancy) {
+  return bishop_attacks(square, occupancy) | rook_attacks(square, occupancy);
+}
+
+static inline Bitboard pieces_of(const Board* board, enum Piece piece, enum Color color) {
+  return board->pieces[piece] & board->colors[color];
+}
+
+static inline Bitboard occupancy(const Board* board) {
+  return board->colors[WHITE] | board->colors[BLACK];
+}
+
+// Pieces of either color attacking square, with sliders blocked by occupied.
+Bitboard attackers_to(const Board* board, int square, Bitboard occupied);
+bool square_attacked(const Board* board, int square, enum Color by);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "grubchess.h"
+#include "book.h"
+#include "hashtable.h"
+#include "uci.h"
+
+uint64_t read_big_endian(const uint8_t* bytes, int size) {
+  uint64_t value = 0;
+  for(int i=0; i<size; i++) {
+    value = value << 8 | bytes[i];
+  }
+  return value;
+}
+
+void write_big_endian(uint8_t* bytes, uint64_t value, int size) {
+  for(int i=size-1; i>=0; i--) {
+    bytes[i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+// Polyglot numbers promotions from knight = 1 to queen = 4, and writes
+// castling as the king taking its own rook.
+uint16_t encode_book_move(const Board* board, Move move, enum Piece promotion) {
+  if(get_square(board, move.from).piece == KING && abs(move.to.file - move.from.file) == 2) {
+    move.to.file = move.to.file > move.from.file ? 7 : 0;
+  }
+  int promoted = promotion >= KNIGHT && promotion <= QUEEN ? promotion - KNIGHT + 1 : 0;
+  return move.to.file | move.to.rank << 3 | move.from.file << 6 | move.from.rank << 9 | promoted << 12;
+}
+
+Move decode_book_move(const Board* board, uint16_t packed) {
+  Move move = {{(packed >> 9) & 7, (packed >> 6) & 7}, {(packed >> 3) & 7, packed & 7}};
+  Square rook = get_square(board, move.to);
+  if(get_square(board, move.from).piece == KING && rook.piece == ROOK && rook.color == board->move) {
+    move.to.file = move.to.file > move.from.file ? move.from.file + 2 : move.from.file - 2;
+  }
+  return move;
+}
+
+// Changes whenever init_zobrist would hash positions differently.
+uint32_t zobrist_fingerprint() {
+  uint64_t fold = 0;
+  for(int color=0; color<NUM_COLORS; color++) {
+    for(int piece=PAWN; piece<NUM_PIECES; piece++) {
+      for(int square=0; square<BOARD_WIDTH * BOARD_WIDTH; square++) {
+        fold = (fold << 7 | fold >> 57) ^ ZOBRIST_PIECES[color][piece][square];
+      }
+    }
+  }
+  Board board;
+  reset_board(&board);
+  fold ^= board.hash;
+  return fold ^ fold >> 32;
+}
+
+BookEntry book_header() {
+  BookEntry header = {{0}};
+  memcpy(header.key, BOOK_MAGIC, sizeof(header.key));
+  write_big_endian(header.move, BOOK_VERSION, 2);
+  write_big_endian(header.learn, zobrist_fingerprint(), 4);
+  return header;
+}
+
+bool open_book(Book* book, const char* path) {
+  book->entries = NULL;
+  book->count = 0;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size % sizeof(BookEntry) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  const BookEntry* entries = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file open.
+  if(entries == MAP_FAILED) {
+    return false;
+  }
+  BookEntry header = book_header();
+  if(memcmp(&entries[0], &header, sizeof(header)) != 0) {
+    munmap((void*)entries, info.st_size);
+    return false;
+  }
+  madvise((void*)entries, info.st_size, MADV_RANDOM);
+  book->entries = entries + 1;
+  book->count = info.st_size / sizeof(BookEntry) - 1;
+  return true;
+}
+
+void close_book(Book* book) {
+  if(book->entries) {
+    munmap((void*)(book->entries - 1), (book->count + 1) * sizeof(BookEntry));
+  }
+  book->entries = NULL;
+  book->count = 0;
+}
+
+bool probe_book(const Book* book, const Board* board, Move* move) {
+  // Binary search for the first entry of the position.
+  size_t low = 0;
+  size_t high = book->count;
+  while(low < high) {
+    size_t middle = low + (high - low) / 2;
+    if(read_big_endian(book->entries[middle].key, 8) < board->hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  uint32_t total = 0;
+  size_t end = low;
+  for(; end < book->count && read_big_endian(book->entries[end].key, 8) == board->hash; end++) {
+    total += read_big_endian(book->entries[end].weight, 2);
+  }
+  if(total == 0) {
+    return false;
+  }
+  uint32_t pick = rand() % total;
+  for(size_t i=low; i<end; i++) {
+    uint32_t weight = read_big_endian(book->entries[i].weight, 2);
+    if(pick < weight) {
+      *move = decode_book_move(board, read_big_endian(book->entries[i].move, 2));
+      // A key collision could suggest nonsense; only play legal moves.
+      return move_valid(board, *move);
+    }
+    pick -= weight;
+  }
+  return false;
+}
+
+typedef struct BookRecord {
+  uint64_t key;
+  uint16_t move;
+  uint32_t count;
+} BookRecord;
+
+int compare_book_records(const void* a, const void* b) {
+  const BookRecord* r1 = (const BookRecord*) a;
+  const BookRecord* r2 = (const BookRecord*) b;
+  if(r1->key != r2->key) {
+    return r1->key < r2->key ? -1 : 1;
+  }
+  return (int)r1->move - (int)r2->move;
+}
+
+bool build_book(FILE* games, const char* path, int plies, size_t* entries) {
+  BookRecord* records = NULL;
+  size_t nrecords = 0;
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  while(getline(&line, &line_size, games) > 0) {
+    Board board;
+    reset_board(&board);
+    char* text = strtok(line, " \t\r\n");
+    for(int ply=0; ply<plies && text; ply++, text = strtok(NULL, " \t\r\n")) {
+      if(strlen(text) < 4) {
+        break;
+      }
+      Move move = {{text[1] - '1', text[0] - 'a'}, {text[3] - '1', text[2] - 'a'}};
+      if(!position_valid(move.from) || !position_valid(move.to)) {
+        break;
+      }
+      enum Piece promotion = EMPTY;
+      if(is_promotion(&board, move)) {
+        const char* pieces = "nbrq";
+        char* symbol = text[4] ? strchr(pieces, text[4] | 0x20) : NULL;
+        promotion = symbol ? KNIGHT + (symbol - pieces) : QUEEN;
+      }
+      uint64_t key = board.hash;
+      uint16_t packed = encode_book_move(&board, move, promotion);
+      if(!apply_uci_move(&board, text)) {
+        break; // Skip the rest of a game that stops making sense.
+      }
+      if(nrecords == capacity) {
+        capacity = capacity ? capacity * 2 : 4096;
+        records = realloc(records, capacity * sizeof(BookRecord));
+      }
+      records[nrecords++] = (BookRecord) {key, packed, 1};
+    }
+  }
+  free(line);
+
+  // Merge repeats of a move into one weighted entry.
+  qsort(records, nrecords, sizeof(BookRecord), compare_book_records);
+  size_t nentries = 0;
+  for(size_t i=0; i<nrecords; i++) {
+    if(nentries > 0 && compare_book_records(&records[nentries - 1], &records[i]) == 0) {
+      records[nentries - 1].count++;
+    } else {
+      records[nentries++] = records[i];
+    }
+  }
+
+  FILE* out = fopen(path, "wb");
+  if(out == NULL) {
+    free(records);
+    return false;
+  }
+  BookEntry header = book_header();
+  bool written = fwrite(&header, sizeof(BookEntry), 1, out) == 1;
+  for(size_t i=0; written && i<nentries; i++) {
+    BookEntry entry = {0};
+    write_big_endian(entry.key, records[i].key, 8);
+    write_big_endian(entry.move, records[i].move, 2);
+    write_big_endian(entry.weight, records[i].count < 0xFFFF ? records[i].count : 0xFFFF, 2);
+    written = fwrite(&entry, sizeof(BookEntry), 1, out) == 1;
+  }
+  written = fclose(out) == 0 && written;
+  free(records);
+  *entries = nentries;
+  return written;
+}
@@ -0,0 +1,61 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef BOOK_H
+#define BOOK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "grubchess.h"
+
+// Opening books use the Polyglot file layout: 16 byte big-endian records of
+// (key, move, weight, learn) sorted by key. The keys are our own Zobrist
+// hashes rather than Polyglot's, so books come from build_book, not other
+// tools: the first record is a header holding BOOK_MAGIC as its key, the
+// format version as its move and a fingerprint of the Zobrist keys as its
+// learn field. Books without it, or built with other keys, are rejected.
+#define BOOK_MAGIC "GRUBBOOK"
+#define BOOK_VERSION 1
+typedef struct BookEntry {
+  uint8_t key[8];
+  uint8_t move[2]; // to file, to rank, from file, from rank, promotion; 3 bits each.
+  uint8_t weight[2];
+  uint8_t learn[4]; // Unused.
+} BookEntry;
+
+// A read-only mapping of a book file. The kernel shares its pages between
+// every process mapping the same file, and threads can probe one Book at
+// once.
+typedef struct Book {
+  const BookEntry* entries; // After the header.
+  size_t count;
+} Book;
+
+bool open_book(Book* book, const char* path);
+void close_book(Book* book);
+// Picks one of the position's book moves at random, in proportion to their
+// weights. Returns false when the position isn't in the book.
+bool probe_book(const Book* book, const Board* board, Move* move);
+
+// Writes a book of the first plies moves of every game in games, one game
+// per line as UCI moves from the start position (e2e4 e7e5 ...), weighted
+// by how often each move was played. Returns false if the book couldn't be
+// written; otherwise entries gets the number of entries.
+bool build_book(FILE* games, const char* path, int plies, size_t* entries);
+
+#endif
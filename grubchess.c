@@ -13,6 +13,8 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,9 +23,18 @@ limitations under the License.
 
 #include "grubchess.h"
 #include "ai.h"
+#include "batch.h"
+#include "bitbase.h"
+#include "bitboard.h"
+#include "book.h"
 #include "hashtable.h"
+#include "mcts.h"
+#include "packed.h"
+#include "perft.h"
+#include "queue.h"
+#include "uci.h"
 
-char PIECE_SYMBOLS[] = {' ', 'p', 'n', 'b', 'r', 'q', 'k'};
+char PIECE_SYMBOLS[] = " pnbrqk";
 char* COLOR_NAMES[] = {"WHITE", "BLACK"};
 
 enum Color enemy_color(enum Color color) {
@@ -40,7 +51,18 @@ Square get_square(const Board* board, Position position) {
 }
 
 void set_square(Board* board, Position position, Square value) {
-  board->squares[position.rank * BOARD_WIDTH + position.file] = value;
+  int index = square_index(position);
+  Square old = board->squares[index];
+  Bitboard bit = square_bit(index);
+  board->pieces[old.piece] &= ~bit;
+  board->colors[old.color] &= ~bit;
+  board->hash ^= ZOBRIST_PIECES[old.color][old.piece][index] ^ ZOBRIST_PIECES[value.color][value.piece][index];
+  board->material += PIECE_SQUARE_SCORES[value.color][value.piece][index] - PIECE_SQUARE_SCORES[old.color][old.piece][index];
+  board->squares[index] = value;
+  if(value.piece != EMPTY) {
+    board->pieces[value.piece] |= bit;
+    board->colors[value.color] |= bit;
+  }
 }
 
 bool position_valid(Position position) {
@@ -86,6 +108,7 @@ void fill_rank(Board* board, int rank, Square square) {
 }
 
 void reset_board(Board* board) {
+  memset(board, 0, sizeof(Board));
   board->move = WHITE; // White to move.
   board->en_passant = -1;
   board->can_castle[WHITE][0] = true;
@@ -125,6 +148,49 @@ void reset_board(Board* board) {
     set_square(board, pos, sqr);
   };
 
+  board->hash = compute_hash(board);
+  board->material = compute_material(board);
+}
+
+bool parse_fen(Board* board, const char* fen) {
+  memset(board, 0, sizeof(Board));
+  const Square empty = {EMPTY, BLACK};
+  for(int square=0; square<BOARD_WIDTH*BOARD_WIDTH; square++) {
+    set_square(board, index_position(square), empty);
+  }
+
+  int rank = 7;
+  int file = 0;
+  for(; *fen && *fen != ' '; fen++) {
+    char c = *fen;
+    if(c == '/') {
+      rank--;
+      file = 0;
+    } else if(c >= '1' && c <= '8') {
+      file += c - '0';
+    } else {
+      char* symbol = strchr(PIECE_SYMBOLS + 1, c | 0x20);
+      if(symbol == NULL || rank < 0 || file >= BOARD_WIDTH) {
+        return false;
+      }
+      enum Color color = (c >= 'A' && c <= 'Z') ? WHITE : BLACK;
+      set_square(board, (Position) {rank, file++}, (Square) {symbol - PIECE_SYMBOLS, color});
+    }
+  }
+
+  char side = 'w';
+  char castling[5] = "-";
+  char en_passant[3] = "-";
+  sscanf(fen, " %c %4s %2s", &side, castling, en_passant);
+  board->move = side == 'b' ? BLACK : WHITE;
+  board->can_castle[WHITE][1] = strchr(castling, 'K') != NULL;
+  board->can_castle[WHITE][0] = strchr(castling, 'Q') != NULL;
+  board->can_castle[BLACK][1] = strchr(castling, 'k') != NULL;
+  board->can_castle[BLACK][0] = strchr(castling, 'q') != NULL;
+  board->en_passant = en_passant[0] >= 'a' && en_passant[0] <= 'h' ? en_passant[0] - 'a' : -1;
+  board->hash = compute_hash(board);
+  board->material = compute_material(board);
+  return true;
 }
 
 bool square_valid(Square square) {
@@ -157,6 +223,18 @@ bool move_equal(Move m1, Move m2) {
   return position_equal(m1.from, m2.from) && position_equal(m1.to, m2.to);
 }
 
+bool is_promotion(const Board* board, Move move) {
+  return get_square(board, move.from).piece == PAWN && (move.to.rank == 0 || move.to.rank == 7);
+}
+
+uint16_t pack_move(Move move) {
+  return square_index(move.from) | square_index(move.to) << 6;
+}
+
+Move unpack_move(uint16_t packed) {
+  return (Move) {index_position(packed & 63), index_position((packed >> 6) & 63)};
+}
+
 char square_to_char(Square square) {
   char symbol = PIECE_SYMBOLS[square.piece];
   if(square.color == WHITE) { // Caps for White
@@ -169,6 +247,13 @@ void print_position(Position position) { // chess notation.
   printf("%c%d", 'a' + position.file, position.rank + 1);
 }
 
+void format_move(const Board* board, Move move, char* text) {
+  sprintf(text, "%c%d%c%d", 'a' + move.from.file, move.from.rank + 1, 'a' + move.to.file, move.to.rank + 1);
+  if(is_promotion(board, move)) {
+    strcat(text, "q"); // Moves only promote to queens.
+  }
+}
+
 void print_board(const Board* board) {
   printf("------------------\n");
   for(int rank = BOARD_WIDTH - 1; rank >=0; rank--) {
@@ -184,10 +269,32 @@ void print_board(const Board* board) {
 }
 
 
+#ifdef DEBUG_INCREMENTAL
+// Compares the incrementally kept hash and material against a full rescan.
+void check_incremental(const Board* board, const char* action, Position from, Position to) {
+  const char* mismatch = NULL;
+  if(board->hash != compute_hash(board)) {
+    mismatch = "hash";
+  } else if(board->material != compute_material(board)) {
+    mismatch = "material";
+  }
+  if(mismatch) {
+    printf("Incremental %s mismatch after %s", mismatch, action);
+    print_move(board, from, to);
+    print_board(board);
+    exit(1);
+  }
+}
+#endif
+
 void apply_valid_move(Board* board, Position from, Position to) {
   Square empty = {EMPTY, BLACK};
   Square square =  get_square(board, from);
 
+  // set_square hashes the pieces; the rest of the state is swapped out here
+  // and back in once the move is made.
+  board->hash ^= hash_state(board);
+
   board->en_passant = -1;
   if(square.piece == PAWN) {
     //Promotion
@@ -206,12 +313,14 @@ void apply_valid_move(Board* board, Position from, Position to) {
     }
   }
 
-  // If it's from one of the four corners of the board you can't castle there now
-  if(square.piece == ROOK
-     && (from.file == 7 || from.file == 0)
-     && (from.rank == 7 || from.rank == 0)) {
-    bool which_rook = !!from.file; // 0 = A file, 1 = H file
-    board->can_castle[board->move][which_rook] = false;
+  // Once a rook leaves its corner, or is captured there, it can't castle.
+  for(int color = 0; color < NUM_COLORS; color++) {
+    for(int rook = 0; rook < 2; rook++) {
+      Position corner = {color * 7, rook * 7};
+      if(position_equal(from, corner) || position_equal(to, corner)) {
+        board->can_castle[color][rook] = false;
+      }
+    }
   }
 
   if(square.piece == KING) {
@@ -234,10 +343,67 @@ void apply_valid_move(Board* board, Position from, Position to) {
   set_square(board, from, empty);
 
   board->move = enemy_color(board->move);
+  board->hash ^= hash_state(board);
+
+#ifdef DEBUG_INCREMENTAL
+  check_incremental(board, "", from, to);
+#endif
 }
 
-bool winning_move(const Board* board, Position to) {
-  return get_square(board, to).piece==KING;
+void make_move(Board* board, Move move, Undo* undo) {
+  undo->moved = get_square(board, move.from);
+  undo->captured = get_square(board, move.to);
+  undo->captured_at = move.to;
+  if(undo->moved.piece == PAWN && move.from.file != move.to.file && undo->captured.piece == EMPTY) {
+    undo->captured_at = (Position) {move.from.rank, move.to.file};
+    undo->captured = get_square(board, undo->captured_at);
+  } else if(undo->moved.piece == KING && abs(move.to.file - move.from.file) > 1) {
+    undo->captured_at = (Position) {move.from.rank, (move.to.file > move.from.file) * 7};
+    undo->captured = get_square(board, undo->captured_at);
+  }
+  undo->en_passant = board->en_passant;
+  memcpy(undo->can_castle, board->can_castle, sizeof(board->can_castle));
+  undo->hash = board->hash;
+  apply_valid_move(board, move.from, move.to);
+}
+
+void unmake_move(Board* board, Move move, const Undo* undo) {
+  Square empty = {EMPTY, BLACK};
+  set_square(board, move.to, empty);
+  if(undo->moved.piece == KING && abs(move.to.file - move.from.file) > 1) {
+    set_square(board, (Position) {move.from.rank, (move.from.file + move.to.file) / 2}, empty);
+  }
+  set_square(board, undo->captured_at, undo->captured);
+  set_square(board, move.from, undo->moved);
+  board->en_passant = undo->en_passant;
+  memcpy(board->can_castle, undo->can_castle, sizeof(board->can_castle));
+  board->move = enemy_color(board->move);
+  board->hash = undo->hash;
+
+#ifdef DEBUG_INCREMENTAL
+  check_incremental(board, "taking back ", move.from, move.to);
+#endif
+}
+
+// Passes the turn, for null move pruning.
+void make_null_move(Board* board, Undo* undo) {
+  undo->en_passant = board->en_passant;
+  undo->hash = board->hash;
+  board->hash ^= hash_state(board);
+  board->en_passant = -1;
+  board->move = enemy_color(board->move);
+  board->hash ^= hash_state(board);
+}
+
+void unmake_null_move(Board* board, const Undo* undo) {
+  board->en_passant = undo->en_passant;
+  board->move = enemy_color(board->move);
+  board->hash = undo->hash;
+}
+
+bool in_check(const Board* board) {
+  Bitboard king = pieces_of(board, KING, board->move);
+  return king && square_attacked(board, lsb(king), enemy_color(board->move));
 }
 
 
@@ -290,7 +456,18 @@ bool try_capture_en_passant(const Board* board, Position from, Position to, Vali
   return false;
 }
 
-void valid_moves_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data) {
+// The king may not castle out of, through or into check.
+bool castling_attacked(const Board* board, int rank, int rook) {
+  int direction = rook ? 1 : -1;
+  for(int file = 4; file != 4 + 3 * direction; file += direction) {
+    if(square_attacked(board, rank * BOARD_WIDTH + file, enemy_color(board->move))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void mailbox_valid_moves_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data) {
   Square square = get_square(board, position);
   if(square.color != board->move) { // You can only move your own pieces!
     return;
@@ -389,7 +566,8 @@ void valid_moves_from(const Board* board, Position position, ValidMovesCallback
           int direction = rook? 1 : -1;
 
           if(board->can_castle[board->move][rook]) {
-            if(get_square(board,(Position) {position.rank, rook*7}).piece == ROOK) {
+            Square corner = get_square(board,(Position) {position.rank, rook*7});
+            if(corner.piece == ROOK && corner.color == board->move) {
               
               bool clear = true;
               for(int file = position.file + direction; file != rook * 7; file+=direction) {
@@ -402,20 +580,7 @@ void valid_moves_from(const Board* board, Position position, ValidMovesCallback
                 Position final = {position.rank, position.file + direction * 2};
                 
                 // Validate that we don't castle into/through/out of check.
-                Board newboard = *board;
-                //We check the threats AFTER the move is applied, so there is no possibility
-                //of an infinite loop.
-                apply_valid_move(&newboard, position, final);
-                ThreatsBoard threats= {0};
-                valid_moves(&newboard, sum_threats_callback, &threats);
-                bool in_check = false;
-                for(int file = position.file; file != rook * 7; file+=direction) {
-                  int nthreats = *get_threat_board(&threats, (Position) {position.rank, file});
-                  if(nthreats) {
-                    in_check = true;
-                  }
-                }
-                if(!in_check) {
+                if(!castling_attacked(board, position.rank, rook)) {
                   callback(board, position, final, callback_data);
                 }
               }
@@ -440,13 +605,249 @@ void valid_moves_from(const Board* board, Position position, ValidMovesCallback
   }
 }
 
-void valid_moves(const Board* board, ValidMovesCallback callback, void* callback_data) {
+void mailbox_valid_moves(const Board* board, ValidMovesCallback callback, void* callback_data) {
   for(int rank = 0; rank<BOARD_WIDTH; rank++) {
     for(int file = 0; file<BOARD_WIDTH; file++) {
       Position pos = {rank, file};
-      valid_moves_from(board, pos, callback, callback_data);
+      mailbox_valid_moves_from(board, pos, callback, callback_data);
+    }
+  }
+}
+
+void emit_moves(const Board* board, int from, Bitboard targets, ValidMovesCallback callback, void* callback_data) {
+  Position from_pos = index_position(from);
+  while(targets) {
+    callback(board, from_pos, index_position(pop_lsb(&targets)), callback_data);
+  }
+}
+
+// Checkers and pinned pieces of the side to move, found once per position
+// so the generators only emit legal moves.
+typedef struct MoveMasks {
+  int king; // -1 if the side to move has no king.
+  Bitboard checkers;
+  Bitboard pinned;
+  // Where pieces other than the king may go: anywhere not our own, or when
+  // in check, onto the checker or between it and the king.
+  Bitboard evasions;
+} MoveMasks;
+
+void compute_move_masks(const Board* board, MoveMasks* masks) {
+  enum Color color = board->move;
+  Bitboard own = board->colors[color];
+  Bitboard enemies = board->colors[enemy_color(color)];
+  Bitboard king = pieces_of(board, KING, color);
+  masks->king = -1;
+  masks->checkers = 0;
+  masks->pinned = 0;
+  masks->evasions = ~own;
+  if(!king) {
+    return;
+  }
+  int square = lsb(king);
+  Bitboard occupied = own | enemies;
+  masks->king = square;
+  masks->checkers = attackers_to(board, square, occupied) & enemies;
+  if(masks->checkers) {
+    bool double_check = masks->checkers & (masks->checkers - 1);
+    masks->evasions = double_check ? 0 : BETWEEN[square][lsb(masks->checkers)] | masks->checkers;
+  }
+
+  // A piece of ours alone between the king and an enemy slider is pinned.
+  Bitboard snipers = ((rook_attacks(square, 0) & (board->pieces[ROOK] | board->pieces[QUEEN]))
+                      | (bishop_attacks(square, 0) & (board->pieces[BISHOP] | board->pieces[QUEEN]))) & enemies;
+  while(snipers) {
+    Bitboard blockers = BETWEEN[square][pop_lsb(&snipers)] & occupied;
+    if(blockers && !(blockers & (blockers - 1))) {
+      masks->pinned |= blockers & own;
+    }
+  }
+}
+
+// Legal targets for the piece on from, other than the king.
+static inline Bitboard legal_mask(const MoveMasks* masks, int from) {
+  if(masks->pinned & square_bit(from)) {
+    return masks->evasions & LINE[masks->king][from];
+  }
+  return masks->evasions;
+}
+
+// The king's targets that aren't attacked once it has left from.
+Bitboard safe_king_targets(const Board* board, int from, Bitboard targets) {
+  Bitboard occupied = occupancy(board) ^ square_bit(from);
+  Bitboard enemies = board->colors[enemy_color(board->move)];
+  Bitboard safe = 0;
+  while(targets) {
+    int to = pop_lsb(&targets);
+    if(!(attackers_to(board, to, occupied) & enemies)) {
+      safe |= square_bit(to);
     }
   }
+  return safe;
+}
+
+// The en passant target for a pawn on from, if the capture is legal. Both
+// pawns leave their squares at once, which can uncover the king sideways,
+// so the king's attackers are recomputed.
+Bitboard en_passant_target(const Board* board, const MoveMasks* masks, int from) {
+  if(board->en_passant < 0) {
+    return 0;
+  }
+  enum Color color = board->move;
+  int to = (color == WHITE ? 5 : 2) * BOARD_WIDTH + board->en_passant;
+  if(!(PAWN_ATTACKS[color][from] & square_bit(to))) {
+    return 0;
+  }
+  if(masks->king < 0) {
+    return square_bit(to);
+  }
+  Bitboard captured = square_bit(from - from % BOARD_WIDTH + board->en_passant);
+  Bitboard occupied = (occupancy(board) ^ square_bit(from) ^ captured) | square_bit(to);
+  Bitboard attackers = attackers_to(board, masks->king, occupied) & board->colors[enemy_color(color)] & ~captured;
+  return attackers ? 0 : square_bit(to);
+}
+
+void masked_moves_from(const Board* board, const MoveMasks* masks, int from, ValidMovesCallback callback, void* callback_data) {
+  Position position = index_position(from);
+  Square square = board->squares[from];
+  enum Color color = square.color;
+  Bitboard own = board->colors[color];
+  Bitboard occupied = occupancy(board);
+  Bitboard enemies = board->colors[enemy_color(color)];
+
+  switch(square.piece) {
+    case PAWN:
+      {
+        Bitboard bit = square_bit(from);
+        Bitboard front = (color == WHITE ? bit << BOARD_WIDTH : bit >> BOARD_WIDTH) & ~occupied;
+        Bitboard targets = front;
+        if(front && position.rank == (color == WHITE ? 1 : 6)) {
+          targets |= (color == WHITE ? front << BOARD_WIDTH : front >> BOARD_WIDTH) & ~occupied;
+        }
+        targets |= PAWN_ATTACKS[color][from] & enemies;
+        targets &= legal_mask(masks, from);
+        emit_moves(board, from, targets | en_passant_target(board, masks, from), callback, callback_data);
+      }
+      break;
+    case KNIGHT:
+      emit_moves(board, from, KNIGHT_ATTACKS[from] & legal_mask(masks, from), callback, callback_data);
+      break;
+    case BISHOP:
+      emit_moves(board, from, bishop_attacks(from, occupied) & legal_mask(masks, from), callback, callback_data);
+      break;
+    case ROOK:
+      emit_moves(board, from, rook_attacks(from, occupied) & legal_mask(masks, from), callback, callback_data);
+      break;
+    case QUEEN:
+      emit_moves(board, from, queen_attacks(from, occupied) & legal_mask(masks, from), callback, callback_data);
+      break;
+    case KING:
+      // King must be in starting position for his color.
+      if(position.file == 4 && position.rank == color * 7 && !masks->checkers) {
+        for(int rook = 0; rook < 2; rook++) {
+          Bitboard between = (rook ? 0x60ull : 0x0Eull) << (position.rank * BOARD_WIDTH);
+          if(board->can_castle[color][rook]
+             && (pieces_of(board, ROOK, color) & square_bit(position.rank * BOARD_WIDTH + rook * 7))
+             && !(occupied & between)
+             && !castling_attacked(board, position.rank, rook)) {
+            Position final = {position.rank, position.file + (rook ? 2 : -2)};
+            callback(board, position, final, callback_data);
+          }
+        }
+      }
+      emit_moves(board, from, safe_king_targets(board, from, KING_ATTACKS[from] & ~own), callback, callback_data);
+      break;
+    default:
+      printf("Unable to handle piece type %d\n", square.piece);
+      break;
+  }
+}
+
+void valid_moves_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data) {
+  int from = square_index(position);
+  Square square = board->squares[from];
+  if(square.color != board->move || square.piece == EMPTY) { // You can only move your own pieces!
+    return;
+  }
+  MoveMasks masks;
+  compute_move_masks(board, &masks);
+  masked_moves_from(board, &masks, from, callback, callback_data);
+}
+
+void valid_moves(const Board* board, ValidMovesCallback callback, void* callback_data) {
+  MoveMasks masks;
+  compute_move_masks(board, &masks);
+  Bitboard own = board->colors[board->move];
+  if(masks.checkers & (masks.checkers - 1)) {
+    own = square_bit(masks.king); // Only the king can answer a double check.
+  }
+  while(own) {
+    masked_moves_from(board, &masks, pop_lsb(&own), callback, callback_data);
+  }
+}
+
+// The subset of masked_moves_from that captures or promotes.
+void masked_captures_from(const Board* board, const MoveMasks* masks, int from, ValidMovesCallback callback, void* callback_data) {
+  Position position = index_position(from);
+  Square square = board->squares[from];
+  enum Color color = square.color;
+  Bitboard occupied = occupancy(board);
+  Bitboard enemies = board->colors[enemy_color(color)];
+
+  switch(square.piece) {
+    case PAWN:
+      {
+        Bitboard targets = PAWN_ATTACKS[color][from] & enemies;
+        if(position.rank == (color == WHITE ? 6 : 1)) {
+          Bitboard bit = square_bit(from);
+          targets |= (color == WHITE ? bit << BOARD_WIDTH : bit >> BOARD_WIDTH) & ~occupied;
+        }
+        targets &= legal_mask(masks, from);
+        emit_moves(board, from, targets | en_passant_target(board, masks, from), callback, callback_data);
+      }
+      break;
+    case KNIGHT:
+      emit_moves(board, from, KNIGHT_ATTACKS[from] & enemies & legal_mask(masks, from), callback, callback_data);
+      break;
+    case BISHOP:
+      emit_moves(board, from, bishop_attacks(from, occupied) & enemies & legal_mask(masks, from), callback, callback_data);
+      break;
+    case ROOK:
+      emit_moves(board, from, rook_attacks(from, occupied) & enemies & legal_mask(masks, from), callback, callback_data);
+      break;
+    case QUEEN:
+      emit_moves(board, from, queen_attacks(from, occupied) & enemies & legal_mask(masks, from), callback, callback_data);
+      break;
+    case KING:
+      emit_moves(board, from, safe_king_targets(board, from, KING_ATTACKS[from] & enemies), callback, callback_data);
+      break;
+    default:
+      printf("Unable to handle piece type %d\n", square.piece);
+      break;
+  }
+}
+
+void valid_captures_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data) {
+  int from = square_index(position);
+  Square square = board->squares[from];
+  if(square.color != board->move || square.piece == EMPTY) {
+    return;
+  }
+  MoveMasks masks;
+  compute_move_masks(board, &masks);
+  masked_captures_from(board, &masks, from, callback, callback_data);
+}
+
+void valid_captures(const Board* board, ValidMovesCallback callback, void* callback_data) {
+  MoveMasks masks;
+  compute_move_masks(board, &masks);
+  Bitboard own = board->colors[board->move];
+  if(masks.checkers & (masks.checkers - 1)) {
+    own = square_bit(masks.king);
+  }
+  while(own) {
+    masked_captures_from(board, &masks, pop_lsb(&own), callback, callback_data);
+  }
 }
 
 
@@ -481,11 +882,26 @@ void save_move_callback(const Board* board, Position from, Position to, void* da
   *(*dat)++ = (Move) {from, to};
 }
 
+void save_move_list_callback(const Board* board, Position from, Position to, void* data) {
+  MoveList* list = (MoveList*)data;
+  list->moves[list->count++] = (Move) {from, to};
+}
+
+void generate_moves(const Board* board, MoveList* list) {
+  list->count = 0;
+  valid_moves(board, save_move_list_callback, list);
+}
+
+void generate_captures(const Board* board, MoveList* list) {
+  list->count = 0;
+  valid_captures(board, save_move_list_callback, list);
+}
+
 void valid_moves_sorted(const Board* board, int (compar) (const void*, const void*, void*), ValidMovesCallback callback, void* callback_data) {
   Move moves[256];
   Move* moves_ptr = moves;
   valid_moves(board, save_move_callback, &moves_ptr);
-  qsort_r(moves, moves_ptr - moves, sizeof(Move), compar, board);
+  qsort_r(moves, moves_ptr - moves, sizeof(Move), compar, (void*)board);
   for(Move* m=moves; m<moves_ptr; m++) {
     callback(board, m->from, m->to, callback_data);
   }
@@ -527,23 +943,189 @@ Move random_move(const Board* board) {
     return move_buffer[chosen];
 }
 
-Move minimax_engine(const Board* board) {
-  int depth = 8;
-  Move best_moves[depth+100];
-  memset(best_moves, 0, sizeof(Move) * (depth+100));
-  HashTable table;
-  init_hashtable(&table);
-  int best_score = minimax_score(&table, board, depth, WORST_POSSIBLE_SCORE, BEST_POSSIBLE_SCORE, best_moves);
-  free_hashtable(&table);
-  printf("Found move with score %d\n", best_score);
-  for(int i=0; i<depth+5; i++) {
-    printf(" - ");
-    print_move_t(board, best_moves[i]);
+// Lives for the whole session so later searches start from earlier results.
+HashTable engine_table;
+int engine_threads = 1;
+SearchLimits engine_limits = {.movetime = 5000};
+Book engine_book;
+Bitbases engine_bitbases;
+
+void print_pv(const Board* board, const Move* pv) {
+  Board position = *board;
+  for(int i=0; i<MAX_PLY && pack_move(pv[i]) != 0; i++) {
+    printf(" ");
+    print_position(pv[i].from);
+    print_position(pv[i].to);
+    apply_valid_move(&position, pv[i].from, pv[i].to);
   }
+}
+
+void print_iteration(const Board* board, const SearchResult* result, const Move* pv, void* data) {
+  printf("depth %d score %d time %llu nodes %llu pv", result->depth, result->score,
+         (unsigned long long)result->time, (unsigned long long)result->nodes);
+  print_pv(board, pv);
   printf("\n");
+}
+
+// The reply the last search expects, from its principal variation.
+Move engine_reply;
+
+Move minimax_engine(const Board* board) {
+  Move best_moves[MAX_PLY] = {{{0}}};
+  if(probe_book(&engine_book, board, &best_moves[0])) {
+    printf("Playing book move\n");
+    engine_reply = best_moves[1];
+    return best_moves[0];
+  }
+  new_search_hashtable(&engine_table);
+  SearchResult result = parallel_search(&engine_table, board, &engine_limits, engine_threads, best_moves, print_iteration, NULL);
+  printf("Found move with score %d at depth %d\n", result.score, result.depth);
+  printf("%llu nodes in %llu ms on %d threads, hash table hits %.1f%%\n",
+         (unsigned long long)result.nodes, (unsigned long long)result.time, engine_threads,
+         result.tt_probes ? 100.0 * result.tt_hits / result.tt_probes : 0.0);
+  engine_reply = best_moves[1];
+  return best_moves[0];
+}
+
+// Plays best-first search's move instead of alpha-beta's.
+bool engine_best_first = false;
+
+Move best_first_engine(const Board* board) {
+  Move best_moves[MAX_PLY] = {{{0}}};
+  if(probe_book(&engine_book, board, &best_moves[0])) {
+    printf("Playing book move\n");
+    return best_moves[0];
+  }
+  BestFirstResult result = best_first_search(board, &engine_limits, best_moves);
+  printf("Found move with score %d, pv", result.score);
+  print_pv(board, best_moves);
+  printf("\n%llu expansions, %llu nodes, deepest line %d plies, in %llu ms\n",
+         (unsigned long long)result.expansions, (unsigned long long)result.nodes, result.depth,
+         (unsigned long long)result.time);
   return best_moves[0];
 }
 
+// Plays Monte Carlo tree search's move instead. The tree is kept between
+// moves, and made on first use so -nodes can size it.
+bool engine_mcts = false;
+MctsTree engine_mcts_tree;
+
+Move mcts_engine(const Board* board) {
+  Move best_moves[MAX_PLY] = {{{0}}};
+  if(probe_book(&engine_book, board, &best_moves[0])) {
+    printf("Playing book move\n");
+    return best_moves[0];
+  }
+  if(engine_mcts_tree.nodes == NULL) {
+    init_mcts(&engine_mcts_tree, engine_limits.nodes ? engine_limits.nodes : MCTS_DEFAULT_NODES);
+  }
+  MctsResult result = mcts_search(&engine_mcts_tree, board, &engine_limits, engine_threads, best_moves);
+  printf("Found move with score %d (%.1f%% to win), pv", result.score, 100 * result.win_chance);
+  print_pv(board, best_moves);
+  printf("\n%llu playouts, %llu nodes in %llu ms on %d threads, %llu tree nodes (%llu reused)\n",
+         (unsigned long long)result.playouts, (unsigned long long)result.nodes,
+         (unsigned long long)result.time, engine_threads, (unsigned long long)result.tree_nodes,
+         (unsigned long long)result.reused);
+  return best_moves[0];
+}
+
+// Searching on the human's time. The search runs on its own thread into
+// engine_table, on the position after the expected reply, or on the
+// human's own position to warm the table for every reply when there's
+// none.
+typedef struct Ponder {
+  bool enabled;
+  pthread_t thread;
+  bool running;
+  atomic_bool stop;
+  atomic_bool done;
+  Board board;
+  Move expected; // Null when pondering the human's position.
+  uint64_t start;
+  SearchLimits limits;
+  Move best_moves[MAX_PLY];
+  // The human played the expected reply; best_moves answers it.
+  bool hit;
+
+  int hits;
+  int ponders;
+  uint64_t human_moved; // When the human's last move came in.
+  uint64_t total_latency;
+  int responses;
+} Ponder;
+
+Ponder ponder;
+
+void* ponder_search(void* data) {
+  parallel_search(&engine_table, &ponder.board, &ponder.limits, engine_threads, ponder.best_moves, NULL, NULL);
+  atomic_store(&ponder.done, true);
+  return NULL;
+}
+
+void start_ponder(const Board* board) {
+  Move nullmove = {{0,0},{0,0}};
+  ponder.board = *board;
+  ponder.expected = nullmove;
+  if(pack_move(engine_reply) != 0 && move_valid(board, engine_reply)) {
+    ponder.expected = engine_reply;
+    apply_valid_move(&ponder.board, engine_reply.from, engine_reply.to);
+  }
+  memset(ponder.best_moves, 0, sizeof(ponder.best_moves));
+  // Search until stopped, or to the depth we'd search anyway.
+  ponder.limits = (SearchLimits) {.depth = engine_limits.depth, .stop = &ponder.stop};
+  atomic_store(&ponder.stop, false);
+  atomic_store(&ponder.done, false);
+  ponder.start = time_ms();
+  new_search_hashtable(&engine_table);
+  pthread_create(&ponder.thread, NULL, ponder_search, NULL);
+  ponder.running = true;
+}
+
+// Ends pondering once the human has played move. On a ponder hit the search
+// goes on until it's had the usual time for a move, counting the time spent
+// pondering, so a slow human gets an instant reply.
+void finish_ponder(Move move) {
+  if(!ponder.running) {
+    return;
+  }
+  ponder.hit = false;
+  if(pack_move(ponder.expected) != 0) {
+    ponder.ponders++;
+    if(move_equal(move, ponder.expected)) {
+      ponder.hit = true;
+      ponder.hits++;
+      uint64_t deadline = ponder.start + engine_limits.movetime;
+      while(!atomic_load(&ponder.done)
+            && (engine_limits.movetime ? time_ms() < deadline : engine_limits.depth > 0)) {
+        nanosleep(&(struct timespec) {0, 1000000}, NULL);
+      }
+    }
+  }
+  atomic_store(&ponder.stop, true);
+  pthread_join(ponder.thread, NULL);
+  ponder.running = false;
+}
+
+Move pondering_engine(const Board* board) {
+  Move move;
+  if(ponder.hit && ponder.board.hash == board->hash && pack_move(ponder.best_moves[0]) != 0) {
+    printf("Ponder hit\n");
+    move = ponder.best_moves[0];
+    engine_reply = ponder.best_moves[1];
+  } else {
+    move = minimax_engine(board);
+  }
+  ponder.hit = false;
+  if(ponder.human_moved) {
+    uint64_t latency = time_ms() - ponder.human_moved;
+    ponder.total_latency += latency;
+    ponder.responses++;
+    printf("Replied in %llu ms (average %llu ms), ponder hits %d/%d\n", (unsigned long long)latency,
+           (unsigned long long)(ponder.total_latency / ponder.responses), ponder.hits, ponder.ponders);
+  }
+  return move;
+}
+
 Move human_engine(const Board* board) {
   Move move;
   char* line = NULL;
@@ -570,9 +1152,19 @@ Move human_engine(const Board* board) {
 
 Move human_vs_computer_engine(const Board* board) {
   if(board->move == BLACK) {
-    return human_engine(board);
+    if(ponder.enabled && !engine_best_first && !engine_mcts) {
+      start_ponder(board);
+    }
+    Move move = human_engine(board);
+    ponder.human_moved = time_ms();
+    finish_ponder(move);
+    return move;
+  } else if(engine_best_first) {
+    return best_first_engine(board);
+  } else if(engine_mcts) {
+    return mcts_engine(board);
   } else {
-    return minimax_engine(board);
+    return pondering_engine(board);
   }
 }
 
@@ -584,12 +1176,19 @@ void play_chess(Board* board, EngineCallback* engine) {
     printf("%d Moves played so far\n", game_length);
     print_board(board);
 
-    Move move =  engine(board);
-    print_move_t(board, move);
-    if(winning_move(board, move.to)) {
-      printf("Found winning move!");
+    MoveList moves;
+    generate_moves(board, &moves);
+    if(moves.count == 0) {
+      if(in_check(board)) {
+        printf("Checkmate, %s wins!\n", COLOR_NAMES[enemy_color(board->move)]);
+      } else {
+        printf("Stalemate.\n");
+      }
       break;
     }
+
+    Move move =  engine(board);
+    print_move_t(board, move);
     apply_valid_move(board, move.from, move.to);
     game_length++;
   }
@@ -597,28 +1196,215 @@ void play_chess(Board* board, EngineCallback* engine) {
 
 void test_hashtable() {
   HashTable table;
-  init_hashtable(&table);
+  init_hashtable(&table, 1);
   Board board;
   reset_board(&board);
   Board board2 = board;
   apply_valid_move(&board2, (Position){1,3},(Position){3,3});
+  Move move = {{1,4},{3,4}};
+
+  Entry entry;
+  printf("Lookup! %d\n", lookup_hashtable(&table, &board, &entry));
+  insert_hashtable(&table, &board, 10, 1, BOUND_EXACT, move);
+  insert_hashtable(&table, &board2, 5, 9, BOUND_LOWER, move);
+  printf("Lookup! %d\n", lookup_hashtable(&table, &board, &entry));
+  printf("Found: %d %d %d ", entry.score, entry.depth, entry.bound);
+  print_move_t(&board, entry.move);
+  printf("Lookup! %d\n", lookup_hashtable(&table, &board2, &entry));
+  printf("Found: %d %d %d ", entry.score, entry.depth, entry.bound);
+  print_move_t(&board, entry.move);
+
+  // Fill board's bucket with newer, deeper entries; board should be evicted.
+  new_search_hashtable(&table);
+  for(int i=1; i<=BUCKET_ENTRIES; i++) {
+    Board other = board;
+    other.hash += (uint64_t)i << table.size_pow;
+    insert_hashtable(&table, &other, i, 20, BOUND_EXACT, move);
+  }
+  printf("Lookup after eviction! %d\n", lookup_hashtable(&table, &board, &entry));
+  free_hashtable(&table);
+}
 
-  printf("Lookup! %d\n", lookup_hashtable(&table, &board));
-  insert_hashtable(&table, &board, 10, 0);
-  insert_hashtable(&table, &board2, 5, 9);
-  printf("Lookup! %d\n", lookup_hashtable(&table, &board));
-  Entry* entry = lookup_hashtable(&table, &board);
-  printf("Found: %d %d %d %d\n", entry->occupied, entry->fullhash, entry->score, entry->depth);
-  grow_hashtable(&table);
-  printf("Lookup! %d\n", lookup_hashtable(&table, &board));
-  printf("Found: %d %d %d %d\n", entry->occupied, entry->fullhash, entry->score, entry->depth);
+int move_comparator(const void* m1, const void* m2) {
+  const Move* move1 = (const Move*) m1;
+  const Move* move2 = (const Move*) m2;
+  int from_diff = square_index(move1->from) - square_index(move2->from);
+  if(from_diff) {
+    return from_diff;
+  }
+  return square_index(move1->to) - square_index(move2->to);
+}
+
+// Plays random games and checks the legal generator against the mailbox one.
+void test_bitboard_movegen() {
+  int positions = 0;
+  int mismatches = 0;
+  for(int game=0; game<200; game++) {
+    Board board;
+    reset_board(&board);
+    for(int ply=0; ply<300; ply++) {
+      Move bitboard_moves[256];
+      Move mailbox_moves[256];
+      Move* bitboard_ptr = bitboard_moves;
+      Move* mailbox_ptr = mailbox_moves;
+      valid_moves(&board, save_move_callback, &bitboard_ptr);
+      mailbox_valid_moves(&board, save_move_callback, &mailbox_ptr);
+      // The mailbox generator is pseudo-legal; drop moves leaving the king attacked.
+      Move* legal_ptr = mailbox_moves;
+      for(Move* m=mailbox_moves; m<mailbox_ptr; m++) {
+        Board after = board;
+        apply_valid_move(&after, m->from, m->to);
+        Bitboard king = pieces_of(&after, KING, board.move);
+        if(!king || !square_attacked(&after, lsb(king), after.move)) {
+          *legal_ptr++ = *m;
+        }
+      }
+      mailbox_ptr = legal_ptr;
+      int nmoves = bitboard_ptr - bitboard_moves;
+      qsort(bitboard_moves, nmoves, sizeof(Move), move_comparator);
+      qsort(mailbox_moves, mailbox_ptr - mailbox_moves, sizeof(Move), move_comparator);
+      positions++;
+      if(nmoves != mailbox_ptr - mailbox_moves
+         || memcmp(bitboard_moves, mailbox_moves, nmoves * sizeof(Move)) != 0) {
+        mismatches++;
+        printf("Move lists differ (%d vs %d moves):\n", nmoves, (int)(mailbox_ptr - mailbox_moves));
+        print_board(&board);
+      }
+      if(nmoves == 0) {
+        break;
+      }
+      Move move = bitboard_moves[rand() % nmoves];
+      apply_valid_move(&board, move.from, move.to);
+    }
+  }
+  printf("Checked %d positions, %d mismatches\n", positions, mismatches);
+}
+
+// Round-trips the positions of random games through the packed encoding,
+// then times bulk conversion of them against FEN parsing.
+void test_packed_boards() {
+  const int max_boards = 20000;
+  Board* boards = malloc(max_boards * sizeof(Board));
+  Board* unpacked = malloc(max_boards * sizeof(Board));
+  PackedBoard* packed = malloc(max_boards * sizeof(PackedBoard));
+  int nboards = 0;
+  while(nboards < max_boards) {
+    Board board;
+    reset_board(&board);
+    for(int ply=0; ply<300 && nboards < max_boards; ply++) {
+      boards[nboards++] = board;
+      Move moves[MAX_MOVES];
+      Move* moves_ptr = moves;
+      valid_moves(&board, save_move_callback, &moves_ptr);
+      int nmoves = moves_ptr - moves;
+      if(nmoves == 0) {
+        break;
+      }
+      Move move = moves[rand() % nmoves];
+      apply_valid_move(&board, move.from, move.to);
+    }
+  }
+
+  size_t failed = pack_boards(boards, packed, nboards) + unpack_boards(packed, unpacked, nboards);
+  int mismatches = 0;
+  for(int i=0; i<nboards; i++) {
+    PackedBoard repacked;
+    pack_board(&unpacked[i], &repacked);
+    if(memcmp(boards[i].squares, unpacked[i].squares, sizeof(boards[i].squares)) != 0
+       || memcmp(boards[i].can_castle, unpacked[i].can_castle, sizeof(boards[i].can_castle)) != 0
+       || memcmp(boards[i].pieces, unpacked[i].pieces, sizeof(boards[i].pieces)) != 0
+       || memcmp(boards[i].colors, unpacked[i].colors, sizeof(boards[i].colors)) != 0
+       || boards[i].move != unpacked[i].move || boards[i].en_passant != unpacked[i].en_passant
+       || boards[i].hash != unpacked[i].hash || boards[i].material != unpacked[i].material
+       || memcmp(&packed[i], &repacked, sizeof(PackedBoard)) != 0) {
+      mismatches++;
+      print_board(&boards[i]);
+    }
+  }
+  printf("Round-tripped %d positions, %zu failed, %d mismatches\n", nboards, failed, mismatches);
 
-  entry = lookup_hashtable(&table, &board2);
-  printf("Found: %d %d %d %d\n", entry->occupied, entry->fullhash, entry->score, entry->depth);
-  grow_hashtable(&table);
-  printf("Lookup! %d\n", lookup_hashtable(&table, &board2));
-  printf("Found: %d %d %d %d\n", entry->occupied, entry->fullhash, entry->score, entry->depth);
+  const int rounds = 50;
+  uint64_t start = time_ms();
+  for(int round=0; round<rounds; round++) {
+    pack_boards(boards, packed, nboards);
+  }
+  uint64_t pack_ms = time_ms() - start;
+  start = time_ms();
+  for(int round=0; round<rounds; round++) {
+    unpack_boards(packed, unpacked, nboards);
+  }
+  uint64_t unpack_ms = time_ms() - start;
+  const int fens = 100000;
+  start = time_ms();
+  for(int i=0; i<fens; i++) {
+    parse_fen(&unpacked[i % nboards], "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+  }
+  uint64_t fen_ms = time_ms() - start;
+  printf("Pack %.1f ns, unpack %.1f ns, parse_fen %.1f ns per position\n",
+         pack_ms * 1e6 / ((double)rounds * nboards), unpack_ms * 1e6 / ((double)rounds * nboards),
+         fen_ms * 1e6 / fens);
+  free(boards);
+  free(unpacked);
+  free(packed);
+}
 
+// Spot-checks the bitbases in ./bitbases against deep searches that don't
+// use them: a mate found by search must be a bitbase win.
+void test_bitbases() {
+  Bitbases bitbases;
+  if(!open_bitbases(&bitbases, "bitbases")) {
+    printf("Generate ./bitbases first\n");
+    return;
+  }
+  const enum Piece pieces[] = {QUEEN, ROOK, PAWN};
+  int mates = 0;
+  int unresolved = 0;
+  int mismatches = 0;
+  for(int sample=0; sample<60; sample++) {
+    Board board;
+    parse_fen(&board, "8/8/8/8/8/8/8/8 w - - 0 1");
+    enum Color strong = rand() % 2;
+    enum Piece piece = pieces[sample % 3];
+    int squares[3];
+    do {
+      for(int i=0; i<3; i++) {
+        squares[i] = rand() % 64;
+      }
+    } while(squares[0] == squares[1] || squares[0] == squares[2] || squares[1] == squares[2]
+            || (KING_ATTACKS[squares[0]] & square_bit(squares[1]))
+            || (piece == PAWN && (squares[2] < 8 || squares[2] >= 56)));
+    set_square(&board, index_position(squares[0]), (Square) {KING, strong});
+    set_square(&board, index_position(squares[1]), (Square) {KING, enemy_color(strong)});
+    set_square(&board, index_position(squares[2]), (Square) {piece, strong});
+    board.move = rand() % 2;
+    board.hash = compute_hash(&board);
+    Bitboard waiting = pieces_of(&board, KING, enemy_color(board.move));
+    if(square_attacked(&board, lsb(waiting), board.move)) {
+      sample--;
+      continue;
+    }
+
+    enum Color probed;
+    bool win;
+    probe_bitbase(&bitbases, &board, &probed, &win);
+    clear_hashtable(&engine_table);
+    Move best_moves[MAX_PLY];
+    SearchLimits limits = {.depth = 16, .nodes = 2000000};
+    SearchResult result = parallel_search(&engine_table, &board, &limits, 1, best_moves, NULL, NULL);
+    int valence = strong == WHITE ? 1 : -1;
+    if(score_is_checkmate(result.score)) {
+      mates++;
+      if(!win || result.score * valence < 0) {
+        mismatches++;
+        printf("Search finds mate, bitbase says %s:\n", win ? "win" : "draw");
+        print_board(&board);
+      }
+    } else {
+      unresolved++;
+    }
+  }
+  printf("%d searches found mate, %d unresolved, %d mismatches\n", mates, unresolved, mismatches);
+  close_bitbases(&bitbases);
 }
 
 void test_evaluation() {
@@ -630,17 +1416,221 @@ void test_evaluation() {
   apply_valid_move(&board, (Position) {0, 3}, (Position) {3, 6});
   apply_valid_move(&board, (Position) {7, 3}, (Position) {5, 5});
   print_board(&board);
-  //printf("SCORED: %d %d %d\n", score_material(&board), score_activity(&board),score_pawn_advancement(&board));
+  //printf("SCORED: %d %d\n", board.material, score_activity(&board));
 }
+void test_see() {
+  struct {
+    const char* fen;
+    Move move;
+    int expected;
+  } exchanges[] = {
+    // Rxe5 Rxe5 Rxe5: the rook behind on e1 x-rays through e2.
+    {"4r1k1/8/8/4p3/8/8/4R3/4R1K1 w - - 0 1", {{1, 4}, {4, 4}}, 100},
+    // Nxe5 dxe5 loses the knight for a pawn.
+    {"4k3/8/3p4/4p3/8/5N2/8/4K3 w - - 0 1", {{2, 5}, {4, 4}}, -200},
+    // Qxe5 dxe5 loses the queen.
+    {"4k3/8/3p4/4p3/8/8/4Q3/4K3 w - - 0 1", {{1, 4}, {4, 4}}, -800},
+    // Nxd5 wins a rook nobody defends.
+    {"4k3/8/8/3r4/8/4N3/8/4K3 w - - 0 1", {{2, 4}, {4, 3}}, 500},
+  };
+  int mismatches = 0;
+  for(int i=0; i<sizeof(exchanges) / sizeof(exchanges[0]); i++) {
+    Board board;
+    parse_fen(&board, exchanges[i].fen);
+    int value = see(&board, exchanges[i].move);
+    if(value != exchanges[i].expected) {
+      mismatches++;
+      printf("SEE of %s is %d, expected %d\n", exchanges[i].fen, value, exchanges[i].expected);
+    }
+  }
+  printf("%d SEE mismatches\n", mismatches);
+}
+
+const char* BENCH_POSITIONS[] = {
+  "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+  "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+  "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+  "r1bq1rk1/ppp2ppp/2np1n2/2b1p3/2B1P3/2NP1N2/PPP2PPP/R1BQ1RK1 w - - 0 7",
+  "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+  "8/2p5/3p4/KP5r/1R3p2/4P1k1/6P1/8 w - - 0 1",
+};
+
+// Searches a fixed set of positions to a fixed depth from an empty table,
+// reporting time to depth and nodes per second.
+void bench(int depth, int threads) {
+  uint64_t total_nodes = 0;
+  uint64_t total_ms = 0;
+  int npositions = sizeof(BENCH_POSITIONS) / sizeof(BENCH_POSITIONS[0]);
+  for(int i=0; i<npositions; i++) {
+    Board board;
+    parse_fen(&board, BENCH_POSITIONS[i]);
+    clear_hashtable(&engine_table);
+    Move best_moves[MAX_PLY];
+    SearchLimits limits = {.depth = depth};
+    SearchResult result = parallel_search(&engine_table, &board, &limits, threads, best_moves, NULL, NULL);
+    uint64_t elapsed = result.time;
+    printf("Position %d: score %d, %llu nodes, %llu ms, best ", i+1, result.score,
+           (unsigned long long)result.nodes, (unsigned long long)elapsed);
+    print_move_t(&board, best_moves[0]);
+    total_nodes += result.nodes;
+    total_ms += elapsed;
+  }
+  printf("Depth %d, %d threads: %llu nodes, %llu ms, %llu nodes/sec\n", depth, threads,
+         (unsigned long long)total_nodes, (unsigned long long)total_ms,
+         (unsigned long long)(total_nodes * 1000 / (total_ms ? total_ms : 1)));
+}
+
 int main(int argc, char** argv) {
   srand(time(NULL));
-  printf("Welcome to GrubChess! Time to get grubby!\n");
+  init_bitboards();
+  init_zobrist();
+  init_evaluation();
+  init_hashtable(&engine_table, DEFAULT_HASH_MB);
 
 
   //test_hashtable();
   //test_evaluation();
+  //test_bitboard_movegen();
+  //test_packed_boards();
+  //test_bitbases();
+  //test_see();
+
+  // grubchess [-threads N] [-movetime ms] [-depth N] [-nodes N] [-perfthash MB]
+  //           [-nonull] [-nolmr] [-book file] [-bitbases dir] [-ponder]
+  //           [-hashfile file] [-stats file] [-bestfirst] [-mcts]
+  //           [bench [depth] | perft [depth [fen]] | batch file | uci
+  //            | makebook games book [plies] | bitbases dir]
+  int perft_hash_mb = 0;
+  bool movetime_set = false;
+  const char* hashfile = NULL;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+      engine_threads = atoi(argv[++i]);
+      if(engine_threads < 1) {
+        printf("-threads needs a positive count\n");
+        return 1;
+      }
+    } else if(strcmp(argv[i], "-movetime") == 0 && i+1 < argc) {
+      engine_limits.movetime = atoi(argv[++i]);
+      movetime_set = true;
+    } else if(strcmp(argv[i], "-depth") == 0 && i+1 < argc) {
+      engine_limits.depth = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-nodes") == 0 && i+1 < argc) {
+      engine_limits.nodes = strtoull(argv[++i], NULL, 10);
+    } else if(strcmp(argv[i], "-perfthash") == 0 && i+1 < argc) {
+      perft_hash_mb = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-nonull") == 0) {
+      search_options.null_move = false;
+    } else if(strcmp(argv[i], "-nolmr") == 0) {
+      search_options.late_move_reductions = false;
+    } else if(strcmp(argv[i], "-book") == 0 && i+1 < argc) {
+      if(!open_book(&engine_book, argv[++i])) {
+        printf("Unable to open book %s\n", argv[i]);
+        return 1;
+      }
+    } else if(strcmp(argv[i], "-hashfile") == 0 && i+1 < argc) {
+      // Starts from the table saved there, if any, and saves it on exit.
+      hashfile = argv[++i];
+      if(load_hashtable(&engine_table, hashfile)) {
+        printf("Loaded hash table from %s\n", hashfile);
+      }
+    } else if(strcmp(argv[i], "-stats") == 0 && i+1 < argc) {
+      // Appends every search's counters to a file ("-" for stdout) as JSON.
+#ifdef SEARCH_STATS
+      i++;
+      search_stats_output = strcmp(argv[i], "-") == 0 ? stdout : fopen(argv[i], "a");
+      if(search_stats_output == NULL) {
+        printf("Unable to open %s\n", argv[i]);
+        return 1;
+      }
+#else
+      printf("Search statistics aren't compiled in; build with make stats\n");
+      return 1;
+#endif
+    } else if(strcmp(argv[i], "-bestfirst") == 0) {
+      // -nodes then bounds the size of its tree.
+      engine_best_first = true;
+    } else if(strcmp(argv[i], "-mcts") == 0) {
+      // Searches on -threads threads, and -nodes bounds its tree.
+      engine_mcts = true;
+    } else if(strcmp(argv[i], "-ponder") == 0) {
+      ponder.enabled = true;
+    } else if(strcmp(argv[i], "-bitbases") == 0 && i+1 < argc) {
+      if(!open_bitbases(&engine_bitbases, argv[++i])) {
+        printf("No bitbases found in %s\n", argv[i]);
+        return 1;
+      }
+      search_options.bitbases = &engine_bitbases;
+    } else if(strcmp(argv[i], "bitbases") == 0 && i+1 < argc) {
+      // Generates the bitbases into a directory, on -threads threads.
+      if(!generate_bitbases(argv[i+1], engine_threads)) {
+        printf("Unable to write bitbases to %s\n", argv[i+1]);
+        return 1;
+      }
+      return 0;
+    } else if(strcmp(argv[i], "makebook") == 0 && i+2 < argc) {
+      // Builds a book from a file of games ("-" for stdin), one per line as
+      // UCI moves, keeping the first plies of each.
+      FILE* games = strcmp(argv[i+1], "-") == 0 ? stdin : fopen(argv[i+1], "r");
+      if(games == NULL) {
+        printf("Unable to open %s\n", argv[i+1]);
+        return 1;
+      }
+      int plies = i+3 < argc ? atoi(argv[i+3]) : 16;
+      size_t entries;
+      if(!build_book(games, argv[i+2], plies, &entries)) {
+        printf("Unable to write book %s\n", argv[i+2]);
+        return 1;
+      }
+      printf("Wrote %zu entries to %s\n", entries, argv[i+2]);
+      return 0;
+    } else if(strcmp(argv[i], "perft") == 0) {
+      // With a FEN, divides that position; otherwise runs the reference suite.
+      int depth = i+1 < argc ? atoi(argv[i+1]) : 4;
+      PerftCache cache;
+      init_perft_cache(&cache, perft_hash_mb);
+      int mismatches = 0;
+      if(i+2 < argc) {
+        Board board;
+        if(!parse_fen(&board, argv[i+2])) {
+          printf("Invalid FEN\n");
+          return 1;
+        }
+        divide(&board, depth, engine_threads, &cache);
+      } else {
+        mismatches = perft_suite(depth, engine_threads, &cache);
+      }
+      free_perft_cache(&cache);
+      return mismatches != 0;
+    } else if(strcmp(argv[i], "batch") == 0 && i+1 < argc) {
+      // Analyzes a file of FEN/EPD lines ("-" for stdin) to -depth/-nodes,
+      // one position per thread.
+      SearchLimits limits = engine_limits;
+      if(!movetime_set && (limits.depth || limits.nodes)) {
+        limits.movetime = 0;
+      }
+      FILE* input = strcmp(argv[i+1], "-") == 0 ? stdin : fopen(argv[i+1], "r");
+      if(input == NULL) {
+        printf("Unable to open %s\n", argv[i+1]);
+        return 1;
+      }
+      batch_analyze(input, stdout, &limits, engine_threads);
+      return 0;
+    } else if(strcmp(argv[i], "uci") == 0) {
+      uci_loop(&engine_table, engine_threads, engine_book.entries ? &engine_book : NULL, hashfile);
+      return 0;
+    } else if(strcmp(argv[i], "bench") == 0) {
+      bench(i+1 < argc ? atoi(argv[i+1]) : 5, engine_threads);
+      return 0;
+    }
+  }
+
+  printf("Welcome to GrubChess! Time to get grubby!\n");
   Board board;
   reset_board(&board);
   play_chess(&board, human_vs_computer_engine);
   print_board(&board); 
+  if(hashfile && !save_hashtable(&engine_table, hashfile)) {
+    printf("Unable to save hash table to %s\n", hashfile);
+  }
 }
@@ -15,6 +15,9 @@ limitations under the License.
 */
 #ifndef GRUBCHESS_H
 #define GRUBCHESS_H
+
+#include <stdint.h>
+
 enum Piece {
   EMPTY=0,
   PAWN,
@@ -49,6 +52,8 @@ typedef struct Square {
   enum Color color;
 } Square;
 
+typedef uint64_t Bitboard;
+
 typedef struct Board {
   enum Color move;
   Square squares[BOARD_WIDTH * BOARD_WIDTH];
@@ -57,24 +62,82 @@ typedef struct Board {
   // Second index corresponds to A and H file, respectively.
   bool can_castle[NUM_COLORS][2];
 
+  // Bitboard view of squares, kept in sync by set_square.
+  Bitboard pieces[NUM_PIECES];
+  Bitboard colors[NUM_COLORS];
+
+  // Zobrist key, updated incrementally by set_square and apply_valid_move.
+  uint64_t hash;
+  // Material and piece-square score, updated incrementally by set_square.
+  int material;
 } Board;
 
 typedef struct Move {
   Position from;
   Position to;
 } Move;
+
+#define MAX_MOVES 256
+typedef struct MoveList {
+  Move moves[MAX_MOVES];
+  int count;
+} MoveList;
+void generate_moves(const Board* board, MoveList* list);
+// Only captures (en passant included) and promotions, for quiescence.
+void generate_captures(const Board* board, MoveList* list);
+
+bool move_equal(Move m1, Move m2);
+bool move_valid(const Board* board, Move move);
+bool is_promotion(const Board* board, Move move);
+// 16 bit encoding, from and to square in 6 bits each. a1a1 (0) means no move.
+uint16_t pack_move(Move move);
+Move unpack_move(uint16_t packed);
+void reset_board(Board* board);
+// Loads the placement, side to move, castling and en passant fields of a FEN
+// string. Move counters are accepted but ignored.
+bool parse_fen(Board* board, const char* fen);
 Square get_square(const Board* board, Position position);
 void set_square(Board* board, Position position, Square value);
 void apply_valid_move(Board* board, Position from, Position to);
+
+// Everything unmake_move needs to take a move back.
+typedef struct Undo {
+  Square moved;
+  // The captured piece and where it stood: behind the target square for en
+  // passant. Castling records the rook's corner here, so it gets put back.
+  Square captured;
+  Position captured_at;
+  int en_passant;
+  bool can_castle[NUM_COLORS][2];
+  uint64_t hash;
+} Undo;
+void make_move(Board* board, Move move, Undo* undo);
+void unmake_move(Board* board, Move move, const Undo* undo);
+void make_null_move(Board* board, Undo* undo);
+void unmake_null_move(Board* board, const Undo* undo);
+// Whether the side to move's king is attacked.
+bool in_check(const Board* board);
+
 bool occupied(const Board* board, Position position);
+bool position_valid(Position position);
 
 bool board_equal(const Board* b1, const Board* b2);
 char square_to_char(Square square);
 void print_board(const Board* board);
 void print_move(const Board* board, Position from, Position to);
+// Coordinate notation as used by UCI, e.g. e2e4 or e7e8q. text holds 6 chars.
+void format_move(const Board* board, Move move, char* text);
 typedef void ValidMovesCallback(const Board*, Position, Position, void*);
+// Strictly legal moves: checks and pins are found once per call and mask
+// the targets, so no move leaves the king attacked.
 void valid_moves_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data);
 void valid_moves(const Board* board, ValidMovesCallback callback, void* callback_data);
+void valid_captures_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data);
+void valid_captures(const Board* board, ValidMovesCallback callback, void* callback_data);
+// Reference square-by-square generator of pseudo-legal moves, kept to
+// cross-check the bitboard one.
+void mailbox_valid_moves_from(const Board* board, Position position, ValidMovesCallback callback, void* callback_data);
+void mailbox_valid_moves(const Board* board, ValidMovesCallback callback, void* callback_data);
 void valid_moves_sorted(const Board* board, int (compar) (const void*, const void*, void*), ValidMovesCallback callback, void* callback_data);
 
 
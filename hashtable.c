@@ -17,93 +17,276 @@ limitations under the License.
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "grubchess.h"
 
 #include "hashtable.h"
 
-int pow_to_size(int size_pow) {
-  return 1 << size_pow;
+// Zobrist keys. Empty squares hash to zero, so ZOBRIST_PIECES[*][EMPTY] is
+// left unset.
+uint64_t ZOBRIST_PIECES[NUM_COLORS][NUM_PIECES][BOARD_WIDTH * BOARD_WIDTH];
+uint64_t ZOBRIST_CASTLING[NUM_COLORS][2];
+uint64_t ZOBRIST_EN_PASSANT[BOARD_WIDTH];
+uint64_t ZOBRIST_BLACK_TO_MOVE;
+
+uint64_t splitmix64(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
 }
 
-void init_hashtable(HashTable* table) {
-  table->size_pow = 16;
-  table->entries = calloc(pow_to_size(table->size_pow), sizeof(Entry));
-  table->count = 0;
+void init_zobrist() {
+  // Fixed seed, so keys are the same in every run.
+  uint64_t seed = 2018;
+  for(int color=0; color<NUM_COLORS; color++) {
+    for(int piece=PAWN; piece<NUM_PIECES; piece++) {
+      for(int square=0; square<BOARD_WIDTH * BOARD_WIDTH; square++) {
+        ZOBRIST_PIECES[color][piece][square] = splitmix64(&seed);
+      }
+    }
+    for(int rook=0; rook<2; rook++) {
+      ZOBRIST_CASTLING[color][rook] = splitmix64(&seed);
+    }
+  }
+  for(int file=0; file<BOARD_WIDTH; file++) {
+    ZOBRIST_EN_PASSANT[file] = splitmix64(&seed);
+  }
+  ZOBRIST_BLACK_TO_MOVE = splitmix64(&seed);
 }
 
-void free_hashtable(HashTable* table) {
-  table->size_pow = 0;
-  table->count = 0;
-  free(table->entries);
+uint64_t hash_state(const Board* board) {
+  uint64_t hash = 0;
+  for(int color=0; color<NUM_COLORS; color++) {
+    for(int rook=0; rook<2; rook++) {
+      if(board->can_castle[color][rook]) {
+        hash ^= ZOBRIST_CASTLING[color][rook];
+      }
+    }
+  }
+  if(board->en_passant >= 0) {
+    hash ^= ZOBRIST_EN_PASSANT[board->en_passant];
+  }
+  if(board->move == BLACK) {
+    hash ^= ZOBRIST_BLACK_TO_MOVE;
+  }
+  return hash;
 }
 
-#define FNV1_OFFSET_BASIS 14695981039346656037ull
-#define FNV1_PRIME 1099511628211
-uint64_t FNV1Hash(const char* data, int len) {
-  uint64_t hash = FNV1_OFFSET_BASIS;
-  for(int i=0; i<len; i++) {
-    hash ^= data[i];
-    hash *=FNV1_PRIME;
+uint64_t compute_hash(const Board* board) {
+  uint64_t hash = hash_state(board);
+  for(int square=0; square<BOARD_WIDTH * BOARD_WIDTH; square++) {
+    Square sqr = board->squares[square];
+    hash ^= ZOBRIST_PIECES[sqr.color][sqr.piece][square];
   }
   return hash;
 }
 
 uint64_t hash_board(const Board* board) {
-  return FNV1Hash((const char*)board, sizeof(Board));
+  return board->hash;
+}
+
+void init_hashtable(HashTable* table, int size_mb) {
+  uint64_t bytes = (uint64_t)size_mb << 20;
+  table->size_pow = 0;
+  while(((uint64_t)sizeof(Bucket) << (table->size_pow + 1)) <= bytes) {
+    table->size_pow++;
+  }
+  table->buckets = aligned_alloc(sizeof(Bucket), sizeof(Bucket) << table->size_pow);
+  if(table->buckets == NULL) {
+    printf("Unable to allocate a %d MB hash table\n", size_mb);
+    exit(1);
+  }
+  clear_hashtable(table);
+}
+
+void free_hashtable(HashTable* table) {
+  table->size_pow = 0;
+  free(table->buckets);
+  table->buckets = NULL;
+}
+
+void clear_hashtable(HashTable* table) {
+  memset(table->buckets, 0, sizeof(Bucket) << table->size_pow);
+  table->age = 0;
+}
+
+#define AGE_BITS 6
+#define AGE_MASK ((1 << AGE_BITS) - 1)
+
+void new_search_hashtable(HashTable* table) {
+  table->age = (table->age + 1) & AGE_MASK;
+}
+
+uint64_t pack_entry(int score, int depth, enum Bound bound, Move move, int age) {
+  return (uint64_t)pack_move(move)
+    | (uint64_t)(uint32_t)score << 16
+    | (uint64_t)(uint8_t)depth << 48
+    | (uint64_t)bound << 56
+    | (uint64_t)age << 58;
+}
+
+Move entry_move(uint64_t data) {
+  return unpack_move(data & 0xFFFF);
+}
+
+int entry_score(uint64_t data) {
+  return (int32_t)(data >> 16);
 }
 
-int get_mask(const HashTable* table) {
-  return (1 << table->size_pow) - 1;
+int entry_depth(uint64_t data) {
+  return (int8_t)(data >> 48);
 }
 
-int hash_to_bucket(const HashTable* table, uint64_t fullhash) {
-  return fullhash & get_mask(table);
+enum Bound entry_bound(uint64_t data) {
+  return (data >> 56) & 3;
 }
 
-int next_bucket(const HashTable* table, int bucket) {
-  return (bucket+1) & get_mask(table);  
+int entry_age(uint64_t data) {
+  return data >> 58;
+}
+
+Bucket* hash_to_bucket(const HashTable* table, uint64_t hash) {
+  return &table->buckets[hash & ((1ull << table->size_pow) - 1)];
+}
+
+bool lookup_hashtable(HashTable* table, const Board* board, Entry* entry) {
+  uint64_t hash = hash_board(board);
+  Bucket* bucket = hash_to_bucket(table, hash);
+  for(int i=0; i<BUCKET_ENTRIES; i++) {
+    PackedEntry* slot = &bucket->entries[i];
+    uint64_t data = atomic_load_explicit(&slot->data, memory_order_relaxed);
+    uint64_t key = atomic_load_explicit(&slot->key, memory_order_relaxed);
+    if((key ^ data) == hash && entry_bound(data) != BOUND_NONE) {
+      entry->score = entry_score(data);
+      entry->depth = entry_depth(data);
+      entry->bound = entry_bound(data);
+      entry->move = entry_move(data);
+      return true;
+    }
+  }
+  return false;
 }
 
-void do_insert(HashTable* table, uint64_t hash, int score, int depth) {
-  int bucket = hash_to_bucket(table, hash);
-  // Linear Probing
-  while(table->entries[bucket].occupied) {
-    bucket = next_bucket(table, bucket);
+// How much a slot is worth keeping: deep entries from the current search win,
+// and every generation of age costs as much as a few plies of depth.
+int replacement_value(const HashTable* table, uint64_t data) {
+  if(entry_bound(data) == BOUND_NONE) {
+    return -1000;
   }
-  table->entries[bucket] = (Entry) {true, hash, score, depth};
+  int age = (table->age - entry_age(data)) & AGE_MASK;
+  return entry_depth(data) - 4 * age;
 }
 
-Entry* lookup_hashtable(HashTable* table, const Board* board) {
-  int fullhash = hash_board(board);
-  int bucket = hash_to_bucket(table, fullhash);
-  while(table->entries[bucket].occupied) {
-    if(table->entries[bucket].fullhash == fullhash) {
-      return &table->entries[bucket];
-    } else {
-      bucket = next_bucket(table, bucket);
+void insert_hashtable(HashTable* table, const Board* board, int score, int depth, enum Bound bound, Move move) {
+  uint64_t hash = hash_board(board);
+  Bucket* bucket = hash_to_bucket(table, hash);
+  PackedEntry* victim = NULL;
+  int victim_value = 0;
+  for(int i=0; i<BUCKET_ENTRIES; i++) {
+    PackedEntry* slot = &bucket->entries[i];
+    uint64_t data = atomic_load_explicit(&slot->data, memory_order_relaxed);
+    uint64_t key = atomic_load_explicit(&slot->key, memory_order_relaxed);
+    if((key ^ data) == hash) {
+      victim = slot;
+      // Keep the old best move if this search didn't produce one.
+      if(pack_move(move) == 0) {
+        move = entry_move(data);
+      }
+      break;
     }
+    int value = replacement_value(table, data);
+    if(victim == NULL || value < victim_value) {
+      victim = slot;
+      victim_value = value;
+    }
+  }
+  uint64_t data = pack_entry(score, depth, bound, move, table->age);
+  atomic_store_explicit(&victim->data, data, memory_order_relaxed);
+  atomic_store_explicit(&victim->key, hash ^ data, memory_order_relaxed);
+}
+
+// Saved tables start with this header, followed by the buckets as they are in
+// memory, so files are only portable between hosts of the same byte order.
+#define HASHFILE_MAGIC "GRUBHASH"
+#define HASHFILE_VERSION 1
+
+typedef struct HashFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t size_pow;
+  uint32_t age;
+  uint32_t reserved;
+} HashFileHeader;
+
+bool save_hashtable(const HashTable* table, const char* path) {
+  HashFileHeader header = {.version=HASHFILE_VERSION, .size_pow=table->size_pow, .age=table->age};
+  memcpy(header.magic, HASHFILE_MAGIC, sizeof(header.magic));
+  FILE* out = fopen(path, "wb");
+  bool written = out && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(table->buckets, sizeof(Bucket), 1ull << table->size_pow, out) == 1ull << table->size_pow;
+  if(out) {
+    written = fclose(out) == 0 && written;
   }
-  return NULL;
+  return written;
 }
 
-void insert_hashtable(HashTable* table, const Board* board, int score, int depth) {
-  if(++table->count > pow_to_size(table->size_pow)/2) { // Resize at 50% capacity.
-    grow_hashtable(table);
+// Moves a saved slot into the least valuable slot of its bucket here.
+void rehash_entry(HashTable* table, const PackedEntry* saved) {
+  uint64_t data = atomic_load_explicit(&saved->data, memory_order_relaxed);
+  if(entry_bound(data) == BOUND_NONE) {
+    return;
+  }
+  uint64_t hash = atomic_load_explicit(&saved->key, memory_order_relaxed) ^ data;
+  Bucket* bucket = hash_to_bucket(table, hash);
+  PackedEntry* victim = NULL;
+  int victim_value = 0;
+  for(int i=0; i<BUCKET_ENTRIES; i++) {
+    PackedEntry* slot = &bucket->entries[i];
+    int value = replacement_value(table, atomic_load_explicit(&slot->data, memory_order_relaxed));
+    if(victim == NULL || value < victim_value) {
+      victim = slot;
+      victim_value = value;
+    }
+  }
+  if(victim_value < replacement_value(table, data)) {
+    atomic_store_explicit(&victim->data, data, memory_order_relaxed);
+    atomic_store_explicit(&victim->key, hash ^ data, memory_order_relaxed);
   }
-  do_insert(table, hash_board(board), score, depth);
 }
 
-void grow_hashtable(HashTable* table) {
-  int old_size = pow_to_size(table->size_pow);
-  int new_size_pow = table->size_pow + 1;
-  HashTable newtable = {calloc(pow_to_size(new_size_pow), sizeof(Entry)), new_size_pow, table->count};
-  for(int i=0; i<old_size; i++) {
-    Entry* entry = table->entries + i;
-    if(entry->occupied) {
-      do_insert(&newtable, entry->fullhash, entry->score, entry->depth);
+bool load_hashtable(HashTable* table, const char* path) {
+  FILE* in = fopen(path, "rb");
+  if(in == NULL) {
+    return false;
+  }
+  HashFileHeader header;
+  if(fread(&header, sizeof(header), 1, in) != 1
+     || memcmp(header.magic, HASHFILE_MAGIC, sizeof(header.magic)) != 0
+     || header.version != HASHFILE_VERSION || header.size_pow >= 48) {
+    fclose(in);
+    return false;
+  }
+  bool loaded = true;
+  if((int)header.size_pow == table->size_pow) {
+    loaded = fread(table->buckets, sizeof(Bucket), 1ull << table->size_pow, in) == 1ull << table->size_pow;
+  } else {
+    clear_hashtable(table);
+    table->age = header.age & AGE_MASK;
+    Bucket bucket;
+    for(uint64_t i=0; loaded && i < 1ull << header.size_pow; i++) {
+      loaded = fread(&bucket, sizeof(Bucket), 1, in) == 1;
+      for(int j=0; loaded && j<BUCKET_ENTRIES; j++) {
+        rehash_entry(table, &bucket.entries[j]);
+      }
     }
   }
-  free_hashtable(table);
-  *table = newtable;
+  table->age = header.age & AGE_MASK;
+  fclose(in);
+  // Don't search with half a table.
+  if(!loaded) {
+    clear_hashtable(table);
+  }
+  return loaded;
 }
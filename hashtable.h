@@ -17,25 +17,71 @@ limitations under the License.
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
+#include <stdatomic.h>
 #include <stdint.h>
 
+extern uint64_t ZOBRIST_PIECES[NUM_COLORS][NUM_PIECES][BOARD_WIDTH * BOARD_WIDTH];
+
+void init_zobrist();
+// Hash of the side to move, castling rights and en passant file.
+uint64_t hash_state(const Board* board);
+// Recomputes the Zobrist key from scratch; Board.hash is kept up to date
+// incrementally.
+uint64_t compute_hash(const Board* board);
+uint64_t hash_board(const Board* board);
+
+enum Bound {
+  BOUND_NONE=0,
+  BOUND_UPPER, // Failed low: the true score is at most the stored one.
+  BOUND_LOWER, // Failed high: the true score is at least the stored one.
+  BOUND_EXACT
+};
+
+// Unpacked view of a table slot.
 typedef struct Entry {
-  bool occupied;
-  uint64_t fullhash;
   int score;
   int depth;
+  enum Bound bound;
+  Move move;
 } Entry;
 
+// A slot is 16 bytes: a data word packing the move (16 bits), score (32),
+// depth (8), bound (2) and age (6), and the full key XORed with the data.
+// Searcher threads share the table without locks; a slot torn by two
+// concurrent writers no longer XORs back to its key and reads as a miss.
+typedef struct PackedEntry {
+  _Atomic uint64_t key;
+  _Atomic uint64_t data;
+} PackedEntry;
+
+// Four slots make one 64 byte, cache line aligned bucket.
+#define BUCKET_ENTRIES 4
+typedef struct Bucket {
+  PackedEntry entries[BUCKET_ENTRIES];
+} Bucket;
+
+#define DEFAULT_HASH_MB 64
+
 typedef struct HashTable {
-  Entry* entries;
-  int size_pow;
-  int count;
+  Bucket* buckets;
+  int size_pow; // log2 of the number of buckets
+  int age;
 } HashTable;
 
-void init_hashtable(HashTable* table);
+// Allocates the largest power of two number of buckets fitting in size_mb.
+void init_hashtable(HashTable* table, int size_mb);
 void free_hashtable(HashTable* table);
-void grow_hashtable(HashTable* table);
+void clear_hashtable(HashTable* table);
+// Starts a new search generation; entries from older ones are replaced first.
+void new_search_hashtable(HashTable* table);
+
+// Writes the whole table to a file, and reads one back. Entries are keyed by
+// the fixed Zobrist keys, so a saved table stays valid across runs; a file
+// saved at another size is rehashed into this table. Both return false if
+// the file couldn't be written or isn't a saved table.
+bool save_hashtable(const HashTable* table, const char* path);
+bool load_hashtable(HashTable* table, const char* path);
 
-Entry* lookup_hashtable(HashTable* table, const Board* board);
-void insert_hashtable(HashTable* table, const Board* board, int score, int depth);
+bool lookup_hashtable(HashTable* table, const Board* board, Entry* entry);
+void insert_hashtable(HashTable* table, const Board* board, int score, int depth, enum Bound bound, Move move);
 #endif
@@ -0,0 +1,374 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grubchess.h"
+#include "ai.h"
+#include "mcts.h"
+
+// first_child while a thread is expanding the node, and for a node with no
+// legal moves.
+#define EXPANDING UINT32_MAX
+#define TERMINAL (UINT32_MAX - 1)
+
+// Values are kept in fixed point, VALUE_ONE being a win.
+#define VALUE_ONE 65536
+// Weight of exploration in UCT.
+#define EXPLORATION 0.7
+// Score that counts as a three in four chance of winning: two pawns.
+#define SCORE_SCALE 200
+// Playouts between checks of the clock.
+#define PLAYOUT_INTERVAL 256
+
+// Visits and values are counted for the side that moved into the node, so a
+// parent picks the child with the best value for itself. A thread adds its
+// visit on the way down and the value on the way back up, so until then the
+// visit counts as a loss: that virtual loss turns other threads away from the
+// line it's busy with.
+struct MctsNode {
+  _Atomic uint32_t first_child; // 0 until expanded.
+  _Atomic uint32_t visits;
+  _Atomic uint64_t value; // Sum of the results, VALUE_ONE per win.
+  uint16_t move; // Packed move from the parent.
+  uint8_t children;
+  bool mated; // For TERMINAL nodes: checkmate rather than stalemate.
+};
+
+typedef struct MctsThread {
+  SearchThread search; // Scores leaves with a quiescence search.
+  MctsTree* tree;
+  const Board* board;
+  atomic_bool* stop;
+  uint64_t playouts;
+  Move pv[MAX_PLY];
+  pthread_t handle;
+} MctsThread;
+
+void init_mcts(MctsTree* tree, uint64_t capacity) {
+  // Leaves room above for threads overshooting the end at once.
+  if(capacity > 1u << 31) {
+    capacity = 1u << 31;
+  }
+  if(capacity < MAX_MOVES + 1) {
+    capacity = MAX_MOVES + 1;
+  }
+  tree->nodes = malloc(capacity * sizeof(MctsNode));
+  if(tree->nodes == NULL) {
+    printf("Unable to allocate a %llu node tree\n", (unsigned long long)capacity);
+    exit(1);
+  }
+  tree->capacity = capacity;
+  atomic_init(&tree->size, 0);
+  tree->valid = false;
+}
+
+void free_mcts(MctsTree* tree) {
+  free(tree->nodes);
+  tree->nodes = NULL;
+  tree->valid = false;
+}
+
+// Chance of winning for white, from a score in white's point of view. A
+// rational sigmoid, which needs no exp().
+double win_chance(int score) {
+  double x = (double)score / SCORE_SCALE;
+  return 0.5 + 0.5 * x / (1 + fabs(x));
+}
+
+int chance_score(double chance) {
+  double y = 2 * chance - 1;
+  if(y > 0.999) {
+    y = 0.999;
+  } else if(y < -0.999) {
+    y = -0.999;
+  }
+  return y / (1 - fabs(y)) * SCORE_SCALE;
+}
+
+void init_node(MctsNode* node, Move move, uint32_t visits, uint64_t value) {
+  atomic_init(&node->first_child, 0);
+  atomic_init(&node->visits, visits);
+  atomic_init(&node->value, value);
+  node->move = pack_move(move);
+  node->children = 0;
+  node->mated = false;
+}
+
+double node_value(const MctsNode* node) {
+  uint32_t visits = atomic_load_explicit(&node->visits, memory_order_relaxed);
+  uint64_t value = atomic_load_explicit(&node->value, memory_order_relaxed);
+  return visits ? (double)value / VALUE_ONE / visits : 0.5;
+}
+
+// Gives a leaf its children, each scored by a quiescence search and counted
+// as one visit. Returns the result for the side that moved into the leaf:
+// the opposite of its best child's. On failure, when the arena is full, the
+// leaf is left unexpanded.
+bool expand_leaf(MctsThread* thread, MctsNode* leaf, Board* board, double* result) {
+  MoveList moves;
+  generate_moves(board, &moves);
+  if(moves.count == 0) {
+    leaf->mated = in_check(board);
+    atomic_store_explicit(&leaf->first_child, TERMINAL, memory_order_release);
+    *result = leaf->mated ? 1 : 0.5;
+    return true;
+  }
+  MctsTree* tree = thread->tree;
+  uint32_t first = atomic_fetch_add(&tree->size, moves.count);
+  if((uint64_t)first + moves.count > tree->capacity) {
+    atomic_store(&tree->size, tree->capacity);
+    atomic_store_explicit(&leaf->first_child, 0, memory_order_release);
+    return false;
+  }
+  double best = 0;
+  for(int i=0; i<moves.count; i++) {
+    Undo undo;
+    make_move(board, moves.moves[i], &undo);
+    int score = minimax_score(&thread->search, board, 0, WORST_POSSIBLE_SCORE, BEST_POSSIBLE_SCORE, thread->pv);
+    unmake_move(board, moves.moves[i], &undo);
+    double chance = win_chance(score);
+    if(board->move == BLACK) {
+      chance = 1 - chance;
+    }
+    if(chance > best) {
+      best = chance;
+    }
+    init_node(&tree->nodes[first + i], moves.moves[i], 1, chance * VALUE_ONE);
+  }
+  leaf->children = moves.count;
+  atomic_store_explicit(&leaf->first_child, first, memory_order_release);
+  *result = 1 - best;
+  return true;
+}
+
+// Upper confidence bound of the child worth following.
+MctsNode* select_child(MctsTree* tree, MctsNode* node, uint32_t first) {
+  double log_visits = log(atomic_load_explicit(&node->visits, memory_order_relaxed) + 1);
+  MctsNode* best = NULL;
+  double best_bound = -1;
+  for(int i=0; i<node->children; i++) {
+    MctsNode* child = &tree->nodes[first + i];
+    uint32_t visits = atomic_load_explicit(&child->visits, memory_order_relaxed);
+    double bound = node_value(child) + EXPLORATION * sqrt(log_visits / (visits + 1));
+    if(bound > best_bound) {
+      best = child;
+      best_bound = bound;
+    }
+  }
+  return best;
+}
+
+// One playout: follows UCT down to a leaf, expands it and backs the result
+// up the path.
+void playout(MctsThread* thread) {
+  MctsTree* tree = thread->tree;
+  Board board = *thread->board;
+  MctsNode* path[MAX_PLY];
+  int length = 0;
+  MctsNode* node = &tree->nodes[0];
+  atomic_fetch_add_explicit(&node->visits, 1, memory_order_relaxed);
+  path[length++] = node;
+  double result;
+  while(true) {
+    uint32_t first = atomic_load_explicit(&node->first_child, memory_order_acquire);
+    if(first == TERMINAL) {
+      result = node->mated ? 1 : 0.5;
+      break;
+    }
+    if(first == 0) {
+      // Expand it ourselves, unless another thread just claimed it.
+      uint32_t expected = 0;
+      if(atomic_compare_exchange_strong(&node->first_child, &expected, EXPANDING)
+         && expand_leaf(thread, node, &board, &result)) {
+        break;
+      }
+      result = node_value(node);
+      break;
+    }
+    if(first == EXPANDING || length >= MAX_PLY - 1) {
+      result = node_value(node);
+      break;
+    }
+    node = select_child(tree, node, first);
+    atomic_fetch_add_explicit(&node->visits, 1, memory_order_relaxed);
+    path[length++] = node;
+    Undo undo;
+    make_move(&board, unpack_move(node->move), &undo);
+  }
+  // Results alternate between the sides up the path.
+  for(int i = length - 1; i >= 0; i--) {
+    atomic_fetch_add_explicit(&path[i]->value, (uint64_t)(result * VALUE_ONE), memory_order_relaxed);
+    result = 1 - result;
+  }
+  thread->playouts++;
+}
+
+void* mcts_helper(void* arg) {
+  MctsThread* thread = (MctsThread*)arg;
+  while(!atomic_load_explicit(thread->stop, memory_order_relaxed)) {
+    playout(thread);
+  }
+  return NULL;
+}
+
+// Moves the subtree of a node to the front of a fresh arena, children still
+// contiguous, and drops the rest of the tree. Returns its size.
+uint32_t compact_tree(MctsTree* tree, uint32_t root) {
+  MctsNode* nodes = malloc(tree->capacity * sizeof(MctsNode));
+  if(nodes == NULL) {
+    return 0;
+  }
+  const MctsNode* old = tree->nodes;
+  uint32_t size = 1;
+  nodes[0] = old[root];
+  // Breadth first: every copied node's children go to the end.
+  for(uint32_t i=0; i<size; i++) {
+    uint32_t first = atomic_load(&nodes[i].first_child);
+    if(first == TERMINAL || first == 0) {
+      continue;
+    }
+    atomic_store(&nodes[i].first_child, size);
+    for(int j=0; j<nodes[i].children; j++) {
+      nodes[size + j] = old[first + j];
+    }
+    size += nodes[i].children;
+  }
+  free(tree->nodes);
+  tree->nodes = nodes;
+  return size;
+}
+
+// Finds the node for board within two plies of the last search's root, so
+// after our move and the reply. Returns 0 if it isn't in the tree.
+uint32_t find_position(const MctsTree* tree, const Board* board, uint32_t index, const Board* position, int plies) {
+  if(position->hash == board->hash) {
+    return index;
+  }
+  const MctsNode* node = &tree->nodes[index];
+  uint32_t first = atomic_load(&node->first_child);
+  if(plies == 0 || first == 0 || first == TERMINAL) {
+    return 0;
+  }
+  for(int i=0; i<node->children; i++) {
+    Board child = *position;
+    Undo undo;
+    make_move(&child, unpack_move(tree->nodes[first + i].move), &undo);
+    uint32_t found = find_position(tree, board, first + i, &child, plies - 1);
+    if(found) {
+      return found;
+    }
+  }
+  return 0;
+}
+
+MctsResult mcts_search(MctsTree* tree, const Board* board, const SearchLimits* limits, int threads, Move* best_moves) {
+  MctsResult result = {0};
+  uint64_t start = time_ms();
+  uint64_t budget = time_budget(limits, board->move);
+  if(threads < 1) {
+    threads = 1;
+  }
+
+  // Keep what the last search learned about this position.
+  uint32_t root = 0;
+  if(tree->valid && tree->board.hash == board->hash) {
+    result.reused = atomic_load(&tree->size);
+  } else if(tree->valid && (root = find_position(tree, board, 0, &tree->board, 2)) != 0) {
+    result.reused = compact_tree(tree, root);
+  }
+  if(result.reused) {
+    atomic_store(&tree->size, result.reused);
+  } else {
+    init_node(&tree->nodes[0], (Move) {{0, 0}, {0, 0}}, 0, 0);
+    atomic_store(&tree->size, 1);
+  }
+  tree->board = *board;
+  tree->valid = true;
+
+  SearchControl control = {0};
+  atomic_init(&control.stop, false);
+  atomic_init(&control.nodes, 0);
+  control.start = start;
+  control.bitbase_piece = EMPTY;
+  atomic_bool stop;
+  atomic_init(&stop, false);
+
+  MctsThread* workers = calloc(threads, sizeof(MctsThread));
+  for(int i=0; i<threads; i++) {
+    init_search_thread(&workers[i].search, i, NULL, &control);
+    workers[i].tree = tree;
+    workers[i].board = board;
+    workers[i].stop = &stop;
+  }
+  for(int i=1; i<threads; i++) {
+    pthread_create(&workers[i].handle, NULL, mcts_helper, &workers[i]);
+  }
+  // The main thread keeps the clock.
+  while(true) {
+    for(int i=0; i<PLAYOUT_INTERVAL; i++) {
+      playout(&workers[0]);
+    }
+    if((budget && time_ms() - start >= budget)
+       || (limits->stop && atomic_load(limits->stop))
+       || atomic_load(&tree->size) >= tree->capacity
+       || atomic_load(&tree->nodes[0].first_child) == TERMINAL) {
+      break;
+    }
+  }
+  atomic_store(&stop, true);
+  for(int i=0; i<threads; i++) {
+    if(i > 0) {
+      pthread_join(workers[i].handle, NULL);
+    }
+    result.playouts += workers[i].playouts;
+    result.nodes += workers[i].search.nodes;
+  }
+  free(workers);
+
+  // The most visited line.
+  memset(best_moves, 0, sizeof(Move) * MAX_PLY);
+  const MctsNode* node = &tree->nodes[0];
+  result.win_chance = 0.5;
+  for(int ply=0; ply < MAX_PLY - 1; ply++) {
+    uint32_t first = atomic_load(&node->first_child);
+    if(first == 0 || first == TERMINAL) {
+      break;
+    }
+    const MctsNode* best = &tree->nodes[first];
+    for(int i=1; i<node->children; i++) {
+      if(atomic_load(&tree->nodes[first + i].visits) > atomic_load(&best->visits)) {
+        best = &tree->nodes[first + i];
+      }
+    }
+    if(ply == 0) {
+      result.win_chance = node_value(best);
+    }
+    best_moves[ply] = unpack_move(best->move);
+    node = best;
+  }
+  int valence = board->move == WHITE ? 1 : -1;
+  result.score = valence * chance_score(result.win_chance);
+  result.tree_nodes = atomic_load(&tree->size);
+  result.time = time_ms() - start;
+  return result;
+}
@@ -0,0 +1,59 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef MCTS_H
+#define MCTS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ai.h"
+
+// Tree size when not given one: 4M nodes, 96 MB.
+#define MCTS_DEFAULT_NODES (4 << 20)
+
+typedef struct MctsNode MctsNode;
+
+// A Monte Carlo search tree. Nodes come from one arena shared by every
+// search thread, and the tree is kept between moves: the next search starts
+// from the subtree of the position it is asked about, if it's in the tree.
+typedef struct MctsTree {
+  MctsNode* nodes;
+  uint32_t capacity;
+  atomic_uint size;
+  Board board; // Position of nodes[0], if valid.
+  bool valid;
+} MctsTree;
+
+typedef struct MctsResult {
+  int score; // From white's point of view, converted back from the root's value.
+  double win_chance; // Of the side to move, by the root's value.
+  uint64_t playouts; // Selections from the root, in all threads.
+  uint64_t nodes; // Quiescence nodes searched to score leaves.
+  uint64_t reused; // Tree nodes kept from the previous search.
+  uint64_t tree_nodes;
+  uint64_t time; // ms
+} MctsResult;
+
+void init_mcts(MctsTree* tree, uint64_t capacity);
+void free_mcts(MctsTree* tree);
+
+// UCT search from board until limits->movetime or the clock budget runs out,
+// limits->stop is set or the tree is full. threads search the one tree,
+// spread over different lines by virtual loss. best_moves (MAX_PLY long) gets
+// the most visited line.
+MctsResult mcts_search(MctsTree* tree, const Board* board, const SearchLimits* limits, int threads, Move* best_moves);
+
+#endif
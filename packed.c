@@ -0,0 +1,132 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <string.h>
+
+#include "packed.h"
+#include "ai.h"
+#include "bitboard.h"
+#include "hashtable.h"
+
+#define FLAG_BLACK 1
+#define FLAG_CASTLING 1 // Shift of the first castling bit.
+
+static inline void write_occupied(uint8_t* bytes, Bitboard occupied) {
+  for(int i=0; i<8; i++) {
+    bytes[i] = occupied >> (8 * i);
+  }
+}
+
+static inline Bitboard read_occupied(const uint8_t* bytes) {
+  Bitboard occupied = 0;
+  for(int i=0; i<8; i++) {
+    occupied |= (Bitboard)bytes[i] << (8 * i);
+  }
+  return occupied;
+}
+
+static inline bool pack_one(const Board* board, PackedBoard* packed) {
+  Bitboard occupied = occupancy(board);
+  memset(packed, 0, sizeof(PackedBoard));
+  if(popcount(occupied) > PACKED_MAX_PIECES) {
+    return false;
+  }
+  write_occupied(packed->occupied, occupied);
+  for(int i=0; occupied; i++) {
+    int square = pop_lsb(&occupied);
+    Square sqr = board->squares[square];
+    packed->pieces[i / 2] |= (sqr.piece | sqr.color << 3) << (i % 2 * 4);
+  }
+  packed->flags = board->move == BLACK ? FLAG_BLACK : 0;
+  for(int color=0; color<NUM_COLORS; color++) {
+    for(int rook=0; rook<2; rook++) {
+      if(board->can_castle[color][rook]) {
+        packed->flags |= 1 << (FLAG_CASTLING + color * 2 + rook);
+      }
+    }
+  }
+  packed->en_passant = board->en_passant;
+  return true;
+}
+
+static inline bool unpack_one(const PackedBoard* packed, Board* board) {
+  memset(board, 0, sizeof(Board));
+  const Square empty = {EMPTY, BLACK};
+  for(int square=0; square<NUM_SQUARES; square++) {
+    board->squares[square] = empty;
+  }
+  Bitboard occupied = read_occupied(packed->occupied);
+  if(popcount(occupied) > PACKED_MAX_PIECES
+     || packed->en_passant < -1 || packed->en_passant >= BOARD_WIDTH) {
+    return false;
+  }
+
+  // Hash and material are summed here rather than by set_square, which
+  // would also update them for every empty square.
+  uint64_t hash = 0;
+  int material = 0;
+  for(int i=0; occupied; i++) {
+    int square = pop_lsb(&occupied);
+    int nibble = packed->pieces[i / 2] >> (i % 2 * 4) & 0xF;
+    enum Piece piece = nibble & 7;
+    enum Color color = nibble >> 3;
+    if(piece == EMPTY || piece >= NUM_PIECES) {
+      return false;
+    }
+    board->squares[square] = (Square) {piece, color};
+    board->pieces[piece] |= square_bit(square);
+    board->colors[color] |= square_bit(square);
+    hash ^= ZOBRIST_PIECES[color][piece][square];
+    material += PIECE_SQUARE_SCORES[color][piece][square];
+  }
+
+  board->move = packed->flags & FLAG_BLACK ? BLACK : WHITE;
+  for(int color=0; color<NUM_COLORS; color++) {
+    for(int rook=0; rook<2; rook++) {
+      board->can_castle[color][rook] = packed->flags >> (FLAG_CASTLING + color * 2 + rook) & 1;
+    }
+  }
+  board->en_passant = packed->en_passant;
+  board->hash = hash ^ hash_state(board);
+  board->material = material;
+  return true;
+}
+
+bool pack_board(const Board* board, PackedBoard* packed) {
+  return pack_one(board, packed);
+}
+
+bool unpack_board(const PackedBoard* packed, Board* board) {
+  return unpack_one(packed, board);
+}
+
+size_t pack_boards(const Board* boards, PackedBoard* packed, size_t count) {
+  size_t failed = 0;
+  for(size_t i=0; i<count; i++) {
+    failed += !pack_one(&boards[i], &packed[i]);
+  }
+  return failed;
+}
+
+size_t unpack_boards(const PackedBoard* packed, Board* boards, size_t count) {
+  size_t failed = 0;
+  for(size_t i=0; i<count; i++) {
+    if(!unpack_one(&packed[i], &boards[i])) {
+      memset(&boards[i], 0, sizeof(Board));
+      failed++;
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,54 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef PACKED_H
+#define PACKED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "grubchess.h"
+
+// A position in 32 bytes, for storing and sending positions in bulk. Equal
+// positions pack to identical bytes, so packed boards can be compared and
+// hashed with memcmp. The bytes are the same on every host.
+#define PACKED_MAX_PIECES 32
+
+typedef struct PackedBoard {
+  uint8_t occupied[8]; // Occupied squares as a little-endian bitboard.
+  // Piece | color << 3 of each occupied square in ascending square order,
+  // the lower square of each pair in the low nibble. Unused nibbles are 0.
+  uint8_t pieces[PACKED_MAX_PIECES / 2];
+  // Bit 0: black to move. Bits 1-4: can_castle[WHITE][0], [WHITE][1],
+  // [BLACK][0], [BLACK][1].
+  uint8_t flags;
+  int8_t en_passant; // File, or -1.
+  uint8_t reserved[6];
+} PackedBoard;
+
+_Static_assert(sizeof(PackedBoard) == 32, "PackedBoard must be 32 bytes");
+
+// Fails on boards with more than PACKED_MAX_PIECES pieces.
+bool pack_board(const Board* board, PackedBoard* packed);
+// Rebuilds the board with its bitboards, hash and material. Fails on
+// malformed input.
+bool unpack_board(const PackedBoard* packed, Board* board);
+
+// Convert count positions. Return how many failed; those are zeroed.
+size_t pack_boards(const Board* boards, PackedBoard* packed, size_t count);
+size_t unpack_boards(const PackedBoard* packed, Board* boards, size_t count);
+
+#endif
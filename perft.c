@@ -0,0 +1,261 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grubchess.h"
+#include "ai.h"
+#include "bitboard.h"
+#include "perft.h"
+
+// Standard reference positions with known counts, from the Chess
+// Programming Wiki's perft results page.
+#define PERFT_MAX_DEPTH 6
+typedef struct PerftPosition {
+  const char* name;
+  const char* fen;
+  uint64_t counts[PERFT_MAX_DEPTH + 1]; // By depth, 0 when unknown.
+} PerftPosition;
+
+const PerftPosition PERFT_POSITIONS[] = {
+  {"start", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+   {1, 20, 400, 8902, 197281, 4865609, 119060324}},
+  {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+   {1, 48, 2039, 97862, 4085603, 193690690, 0}},
+  {"endgame en passant", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+   {1, 14, 191, 2812, 43238, 674624, 11030083}},
+  {"promotions", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+   {1, 6, 264, 9467, 422333, 15833292, 706045033}},
+  {"castling", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+   {1, 44, 1486, 62379, 2103487, 89941194, 0}},
+  {"middlegame", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+   {1, 46, 2079, 89890, 3894594, 164075551, 0}},
+};
+
+const enum Piece PROMOTIONS[] = {QUEEN, ROOK, BISHOP, KNIGHT};
+
+void init_perft_cache(PerftCache* cache, int size_mb) {
+  cache->entries = NULL;
+  cache->mask = 0;
+  if(size_mb <= 0) {
+    return;
+  }
+  uint64_t size = 1;
+  while((size * 2 * sizeof(PerftEntry)) <= ((uint64_t)size_mb << 20)) {
+    size *= 2;
+  }
+  cache->entries = calloc(size, sizeof(PerftEntry));
+  if(cache->entries == NULL) {
+    printf("Unable to allocate a %d MB perft cache\n", size_mb);
+    exit(1);
+  }
+  cache->mask = size - 1;
+}
+
+void free_perft_cache(PerftCache* cache) {
+  free(cache->entries);
+  cache->entries = NULL;
+  cache->mask = 0;
+}
+
+uint64_t perft_key(const Board* board, int depth) {
+  return board->hash ^ (depth * 0x9E3779B97F4A7C15ull);
+}
+
+bool probe_perft_cache(PerftCache* cache, uint64_t key, uint64_t* count) {
+  PerftEntry* entry = &cache->entries[key & cache->mask];
+  uint64_t stored = atomic_load_explicit(&entry->count, memory_order_relaxed);
+  if((atomic_load_explicit(&entry->key, memory_order_relaxed) ^ stored) != key) {
+    return false;
+  }
+  *count = stored;
+  return true;
+}
+
+void store_perft_cache(PerftCache* cache, uint64_t key, uint64_t count) {
+  PerftEntry* entry = &cache->entries[key & cache->mask];
+  atomic_store_explicit(&entry->count, count, memory_order_relaxed);
+  atomic_store_explicit(&entry->key, key ^ count, memory_order_relaxed);
+}
+
+// make_move always promotes to a queen; swap in the underpromoted piece.
+void make_perft_move(Board* board, Move move, enum Piece promotion, Undo* undo) {
+  make_move(board, move, undo);
+  if(promotion != QUEEN) {
+    set_square(board, move.to, (Square) {promotion, enemy_color(board->move)});
+  }
+}
+
+uint64_t perft(Board* board, int depth, PerftCache* cache) {
+  if(depth == 0) {
+    return 1;
+  }
+  uint64_t key = perft_key(board, depth);
+  uint64_t nodes = 0;
+  if(cache && cache->entries && depth > 1 && probe_perft_cache(cache, key, &nodes)) {
+    return nodes;
+  }
+
+  MoveList moves;
+  generate_moves(board, &moves);
+  for(int i=0; i<moves.count; i++) {
+    Move move = moves.moves[i];
+    int npromotions = is_promotion(board, move) ? 4 : 1;
+    if(depth == 1) {
+      // Generated moves are legal, so the last ply needs only counting.
+      nodes += npromotions;
+      continue;
+    }
+    for(int p=0; p<npromotions; p++) {
+      Undo undo;
+      make_perft_move(board, move, PROMOTIONS[p], &undo);
+      nodes += perft(board, depth - 1, cache);
+      unmake_move(board, move, &undo);
+    }
+  }
+
+  if(cache && cache->entries && depth > 1) {
+    store_perft_cache(cache, key, nodes);
+  }
+  return nodes;
+}
+
+typedef struct RootMove {
+  Move move;
+  enum Piece promotion;
+  uint64_t nodes;
+} RootMove;
+
+typedef struct DivideJob {
+  const Board* board;
+  int depth;
+  PerftCache* cache;
+  RootMove* moves;
+  int count;
+  atomic_int next;
+} DivideJob;
+
+// Threads take root moves one at a time until none are left.
+void* divide_worker(void* data) {
+  DivideJob* job = (DivideJob*) data;
+  Board board = *job->board;
+  int i;
+  while((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+    RootMove* root = &job->moves[i];
+    Undo undo;
+    make_perft_move(&board, root->move, root->promotion, &undo);
+    root->nodes = perft(&board, job->depth - 1, job->cache);
+    unmake_move(&board, root->move, &undo);
+  }
+  return NULL;
+}
+
+// Counts below every legal root move into moves, returning the total.
+uint64_t perft_root(const Board* board, int depth, int threads, PerftCache* cache, RootMove* moves, int* count) {
+  MoveList list;
+  generate_moves(board, &list);
+  *count = 0;
+  for(int i=0; i<list.count; i++) {
+    Move move = list.moves[i];
+    int npromotions = is_promotion(board, move) ? 4 : 1;
+    for(int p=0; p<npromotions; p++) {
+      moves[(*count)++] = (RootMove) {move, PROMOTIONS[p], 1};
+    }
+  }
+  if(depth <= 1) {
+    return *count;
+  }
+
+  DivideJob job = {board, depth, cache, moves, *count};
+  atomic_init(&job.next, 0);
+  if(threads < 1) {
+    threads = 1;
+  }
+  pthread_t* handles = calloc(threads - 1, sizeof(pthread_t));
+  for(int i=0; i<threads-1; i++) {
+    pthread_create(&handles[i], NULL, divide_worker, &job);
+  }
+  divide_worker(&job);
+  for(int i=0; i<threads-1; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  free(handles);
+
+  uint64_t total = 0;
+  for(int i=0; i<*count; i++) {
+    total += moves[i].nodes;
+  }
+  return total;
+}
+
+uint64_t divide(const Board* board, int depth, int threads, PerftCache* cache) {
+  RootMove moves[MAX_MOVES];
+  int count;
+  uint64_t start = time_ms();
+  uint64_t total = perft_root(board, depth, threads, cache, moves, &count);
+  uint64_t elapsed = time_ms() - start;
+  for(int i=0; i<count; i++) {
+    Move move = moves[i].move;
+    printf("%c%d%c%d", 'a' + move.from.file, move.from.rank + 1, 'a' + move.to.file, move.to.rank + 1);
+    if(is_promotion(board, move)) {
+      printf("%c", PIECE_SYMBOLS[moves[i].promotion]);
+    }
+    printf(": %llu\n", (unsigned long long)moves[i].nodes);
+  }
+  printf("Depth %d: %llu nodes, %llu ms, %llu nodes/sec\n", depth, (unsigned long long)total,
+         (unsigned long long)elapsed, (unsigned long long)(total * 1000 / (elapsed ? elapsed : 1)));
+  return total;
+}
+
+int perft_suite(int depth, int threads, PerftCache* cache) {
+  int mismatches = 0;
+  uint64_t total_nodes = 0;
+  uint64_t total_ms = 0;
+  int npositions = sizeof(PERFT_POSITIONS) / sizeof(PERFT_POSITIONS[0]);
+  for(int i=0; i<npositions; i++) {
+    const PerftPosition* position = &PERFT_POSITIONS[i];
+    int d = depth;
+    while(d > 0 && (d > PERFT_MAX_DEPTH || position->counts[d] == 0)) {
+      d--;
+    }
+    Board board;
+    parse_fen(&board, position->fen);
+    if(cache && cache->entries) {
+      memset(cache->entries, 0, (cache->mask + 1) * sizeof(PerftEntry));
+    }
+    RootMove moves[MAX_MOVES];
+    int count;
+    uint64_t start = time_ms();
+    uint64_t nodes = perft_root(&board, d, threads, cache, moves, &count);
+    uint64_t elapsed = time_ms() - start;
+    bool ok = nodes == position->counts[d];
+    mismatches += !ok;
+    printf("%-20s depth %d: %llu nodes, expected %llu, %llu ms %s\n", position->name, d,
+           (unsigned long long)nodes, (unsigned long long)position->counts[d],
+           (unsigned long long)elapsed, ok ? "ok" : "MISMATCH");
+    total_nodes += nodes;
+    total_ms += elapsed;
+  }
+  printf("%d mismatches, %llu nodes, %llu ms, %llu nodes/sec\n", mismatches,
+         (unsigned long long)total_nodes, (unsigned long long)total_ms,
+         (unsigned long long)(total_nodes * 1000 / (total_ms ? total_ms : 1)));
+  return mismatches;
+}
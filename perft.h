@@ -0,0 +1,52 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef PERFT_H
+#define PERFT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "grubchess.h"
+
+// Leaf counts of the legal move tree. Unlike the search, perft lets pawns
+// underpromote.
+
+// Optional table of subtree counts, shared lock-free between threads the
+// same way as the transposition table.
+typedef struct PerftEntry {
+  _Atomic uint64_t key; // Position key mixed with depth, XORed with count.
+  _Atomic uint64_t count;
+} PerftEntry;
+
+typedef struct PerftCache {
+  PerftEntry* entries;
+  uint64_t mask;
+} PerftCache;
+
+// A size of 0 MB disables the cache.
+void init_perft_cache(PerftCache* cache, int size_mb);
+void free_perft_cache(PerftCache* cache);
+
+uint64_t perft(Board* board, int depth, PerftCache* cache);
+// Prints the count below every root move, the total and nodes/sec. Root
+// moves are split between threads.
+uint64_t divide(const Board* board, int depth, int threads, PerftCache* cache);
+// Checks the reference positions at the given depth against their known
+// counts. Returns the number of mismatches.
+int perft_suite(int depth, int threads, PerftCache* cache);
+
+#endif
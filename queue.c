@@ -13,91 +13,316 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
-//2^20
-#define QUEUE_CAPACITY 1048576
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-struct Queue {
+#include "grubchess.h"
+#include "ai.h"
+#include "queue.h"
+
+// 16 bytes. A node's children are allocated together from the pool, so it
+// only keeps the first and their count. Boards aren't stored; a leaf's
+// position is replayed from the root along the moves.
+typedef struct TreeNode {
+  uint32_t parent;
+  uint32_t first_child;
+  // From white's point of view: a leaf's quiescence score, then the minimax
+  // of its children once expanded.
+  int32_t score;
+  uint16_t move; // Packed move from the parent.
+  uint8_t children; // No position has more than 218 legal moves.
+  bool expanded;
+} TreeNode;
+
+// Leaves waiting to be expanded; the queue is a max-heap on key.
+typedef struct QueueEntry {
+  int32_t key;
+  uint32_t node;
+} QueueEntry;
+
+typedef struct Queue {
   QueueEntry* entries;
   int size;
-  int capactiy;
-  bool minheap;
-};
+  int capacity;
+} Queue;
 
-void create_queue(Queue* queue, int capacity, bool minheap) {
+typedef struct Tree {
+  const Board* root;
+  TreeNode* nodes;
+  uint32_t size;
+  uint32_t capacity;
+  Queue queue;
+  // Scores new leaves with a quiescence search.
+  SearchThread* thread;
+  Move pv[MAX_PLY];
+  int depth;
+} Tree;
+
+// Every ply makes a leaf this much less promising (a fifth of a pawn), so the
+// tree keeps some breadth instead of following one line forever.
+#define PLY_PENALTY 20
+// Expansions between checks of the clock.
+#define EXPANSION_INTERVAL 64
+
+void create_queue(Queue* queue, int capacity) {
   queue->entries = malloc(capacity * sizeof(QueueEntry));
   queue->size = 0;
   queue->capacity = capacity;
-  queue->minheap = minheap;
+}
+
+void free_queue(Queue* queue) {
+  free(queue->entries);
+  queue->entries = NULL;
 }
 
 int heap_parent(int index) {
   return (index-1) / 2;
 }
+
+void swap_entries(Queue* queue, int a, int b) {
+  QueueEntry entry = queue->entries[a];
+  queue->entries[a] = queue->entries[b];
+  queue->entries[b] = entry;
+}
+
 void push_up_queue(Queue* queue, int index) {
-  if(index == 0) return;
-  int parent_index = heap_parent(index);
-  if(queue->entries[parent_index].score < queue->entries[index].score) {
-    swap_entries(queue->entries + parent_index, queue->entries + index);
-    heapify_queue(queue, parent_index);
+  while(index > 0 && queue->entries[heap_parent(index)].key < queue->entries[index].key) {
+    swap_entries(queue, heap_parent(index), index);
+    index = heap_parent(index);
   }
-};
+}
 
 void push_down_queue(Queue* queue, int index) {
-  int bestscore = entries[index].score;
-  int bestchild=1;
-  int child1 = index*2;
-  int child2 = index*2+1;
-  if(child2<queue->size) {
-    bestscore = MAX(bestscore, queue->entries[child2].score);
-  }
-
-  if(child1<queue->size) {
-    if(queue->entries[child1].score>bestscore) {
-      swap_entries(index, child1);
-      push_down_queue(queue, child1);
+  while(true) {
+    int best = index;
+    int child1 = index*2 + 1;
+    int child2 = index*2 + 2;
+    if(child1 < queue->size && queue->entries[child1].key > queue->entries[best].key) {
+      best = child1;
     }
-  }
-  if(entries[index].score < bestscore) {
-    swap_entries(index, child2);
-    push_down_queue(queue, child2);
+    if(child2 < queue->size && queue->entries[child2].key > queue->entries[best].key) {
+      best = child2;
+    }
+    if(best == index) {
+      return;
+    }
+    swap_entries(queue, index, best);
+    index = best;
   }
 }
 
-void insert_queue(Queue* queue, const QueueEntry* entry) {
-  int ind = queue->size++;
-  queue->entries[ind] = *entry;
-  queue->entries[ind].score *= -1;
-  push_up_queue(queue, ind);
+void insert_queue(Queue* queue, QueueEntry entry) {
+  int index = queue->size++;
+  queue->entries[index] = entry;
+  push_up_queue(queue, index);
 }
 
-void pop_queue(Queue* queue) {
-  swap_entries(0, queue->size-1);
-  queue->size--;
+QueueEntry pop_queue(Queue* queue) {
+  QueueEntry head = queue->entries[0];
+  queue->entries[0] = queue->entries[--queue->size];
   push_down_queue(queue, 0);
+  return head;
 }
 
+// Plays the moves from the root down to a node. Returns its ply.
+int replay_node(const Tree* tree, uint32_t index, Board* board) {
+  uint16_t moves[MAX_PLY];
+  int ply = 0;
+  for(uint32_t i = index; i != 0; i = tree->nodes[i].parent) {
+    moves[ply++] = tree->nodes[i].move;
+  }
+  *board = *tree->root;
+  Undo undo;
+  for(int i = ply - 1; i >= 0; i--) {
+    make_move(board, unpack_move(moves[i]), &undo);
+  }
+  return ply;
+}
 
-void insert_queue_callback(const Board* board, Position from, Position to, void* data) {
-  Queue* queue = (Queue*) data;
-  QueueEntry entry;
-  entry.board = apply_valid_moves(board, from, to);
-  entry.score = score(entry.board);
-  insert_queue(queue, &entry);
+// A leaf is as promising as the line to it is close to best play: every
+// move on the way costs what it scores below the best move there, and every
+// ply costs PLY_PENALTY. Scores change as the tree grows, so this is
+// recomputed rather than stored.
+int node_key(const Tree* tree, uint32_t index) {
+  int key = 0;
+  for(uint32_t i = index; i != 0; i = tree->nodes[i].parent) {
+    const TreeNode* node = &tree->nodes[i];
+    key -= abs(tree->nodes[node->parent].score - node->score) + PLY_PENALTY;
+  }
+  return key;
 }
 
-void search_n_nodes(const Board* board, int N) {
-  Board bestboard;
+int best_child_score(const Tree* tree, const TreeNode* node, enum Color color) {
+  const TreeNode* children = &tree->nodes[node->first_child];
+  int best = children[0].score;
+  for(int i=1; i<node->children; i++) {
+    if(color == WHITE ? children[i].score > best : children[i].score < best) {
+      best = children[i].score;
+    }
+  }
+  return best;
+}
 
-  Queue queue;
-  create_queue(&queue, N*1000, board->move == BLACK);
-  QueueEntry entry;
-  entry.board = board;
-  entry.score = score(board);
-  insert_queue(&queue, &entry);
-  for(int i=0; i<N; i++) {
-    QueueEntry* head = queue.entries;
+// Minimax backup: recomputes the ancestors of a node whose score changed,
+// stopping at the first one that doesn't.
+void back_up(Tree* tree, uint32_t index, int ply) {
+  while(index != 0) {
+    index = tree->nodes[index].parent;
+    ply--;
+    TreeNode* node = &tree->nodes[index];
+    enum Color color = ply % 2 == 0 ? tree->root->move : enemy_color(tree->root->move);
+    int best = best_child_score(tree, node, color);
+    if(best == node->score) {
+      return;
+    }
+    node->score = best;
+  }
+}
 
-    valid_moves(board, insert_queue_callback, &queue);
+// Scores every child of a leaf and queues them. Returns false if the pool
+// has no room left for them.
+bool expand_node(Tree* tree, uint32_t index) {
+  Board board;
+  int ply = replay_node(tree, index, &board);
+  MoveList moves;
+  generate_moves(&board, &moves);
+  if(tree->size + moves.count > tree->capacity) {
+    return false;
+  }
 
+  TreeNode* node = &tree->nodes[index];
+  node->expanded = true;
+  node->first_child = tree->size;
+  node->children = moves.count;
+  for(int i=0; i<moves.count; i++) {
+    Undo undo;
+    make_move(&board, moves.moves[i], &undo);
+    TreeNode* child = &tree->nodes[tree->size++];
+    child->parent = index;
+    child->first_child = 0;
+    child->move = pack_move(moves.moves[i]);
+    child->children = 0;
+    child->expanded = false;
+    int score = minimax_score(tree->thread, &board, 0, WORST_POSSIBLE_SCORE, BEST_POSSIBLE_SCORE, tree->pv);
+    child->score = score_from_table(score, ply + 1);
+    unmake_move(&board, moves.moves[i], &undo);
   }
+
+  if(moves.count == 0) {
+    // Checkmate or stalemate: final, and never queued again.
+    int valence = board.move == WHITE ? 1 : -1;
+    node->score = in_check(&board) ? -valence * (CHECKMATE_SCORE - ply) : 0;
+  } else {
+    node->score = best_child_score(tree, node, board.move);
+  }
+  back_up(tree, index, ply);
+  if(ply + 1 > tree->depth) {
+    tree->depth = ply + 1;
+  }
+
+  // Leave room for the principal variation's terminating null move.
+  if(ply + 1 < MAX_PLY - 1) {
+    int key = node_key(tree, index);
+    for(uint32_t i = node->first_child; i < node->first_child + node->children; i++) {
+      QueueEntry entry = {key - abs(node->score - tree->nodes[i].score) - PLY_PENALTY, i};
+      insert_queue(&tree->queue, entry);
+    }
+  }
+  return true;
+}
+
+// Expands up to n of the most promising leaves. Returns how many it did,
+// fewer if the tree is full or completely solved.
+int search_n_nodes(Tree* tree, int n) {
+  int expanded = 0;
+  while(expanded < n && tree->queue.size > 0) {
+    QueueEntry entry = pop_queue(&tree->queue);
+    // Backed up scores may have moved since the leaf was queued; put it back
+    // if another leaf is now more promising.
+    int key = node_key(tree, entry.node);
+    if(key < entry.key && tree->queue.size > 0 && key < tree->queue.entries[0].key) {
+      entry.key = key;
+      insert_queue(&tree->queue, entry);
+      continue;
+    }
+    if(!expand_node(tree, entry.node)) {
+      break;
+    }
+    expanded++;
+  }
+  return expanded;
+}
+
+BestFirstResult best_first_search(const Board* board, const SearchLimits* limits, Move* best_moves) {
+  BestFirstResult result = {0};
+  uint64_t start = time_ms();
+  uint64_t budget = time_budget(limits, board->move);
+  uint64_t capacity = limits->nodes ? limits->nodes : BEST_FIRST_DEFAULT_NODES;
+  if(capacity > INT32_MAX) {
+    capacity = INT32_MAX;
+  }
+  if(capacity < MAX_MOVES + 1) {
+    capacity = MAX_MOVES + 1;
+  }
+
+  // Quiescence never stops on its own, so the control block is only there
+  // for the searcher's bookkeeping.
+  SearchControl control = {0};
+  atomic_init(&control.stop, false);
+  atomic_init(&control.nodes, 0);
+  control.start = start;
+  control.bitbase_piece = EMPTY;
+
+  Tree tree;
+  tree.root = board;
+  tree.nodes = malloc(capacity * sizeof(TreeNode));
+  tree.capacity = capacity;
+  tree.depth = 0;
+  create_queue(&tree.queue, capacity);
+  tree.thread = malloc(sizeof(SearchThread));
+  if(tree.nodes == NULL || tree.queue.entries == NULL || tree.thread == NULL) {
+    printf("Unable to allocate a %llu node tree\n", (unsigned long long)capacity);
+    exit(1);
+  }
+  init_search_thread(tree.thread, 0, NULL, &control);
+
+  TreeNode* root = &tree.nodes[0];
+  memset(root, 0, sizeof(TreeNode));
+  root->score = minimax_score(tree.thread, board, 0, WORST_POSSIBLE_SCORE, BEST_POSSIBLE_SCORE, tree.pv);
+  tree.size = 1;
+  insert_queue(&tree.queue, (QueueEntry) {0, 0});
+
+  while(true) {
+    int expanded = search_n_nodes(&tree, EXPANSION_INTERVAL);
+    result.expansions += expanded;
+    if(expanded < EXPANSION_INTERVAL
+       || (budget && time_ms() - start >= budget)
+       || (limits->stop && atomic_load(limits->stop))) {
+      break;
+    }
+  }
+
+  // The principal variation follows the children the scores came from.
+  memset(best_moves, 0, sizeof(Move) * MAX_PLY);
+  const TreeNode* node = &tree.nodes[0];
+  for(int ply=0; ply < MAX_PLY - 1 && node->expanded && node->children > 0; ply++) {
+    const TreeNode* child = &tree.nodes[node->first_child];
+    while(child->score != node->score) {
+      child++;
+    }
+    best_moves[ply] = unpack_move(child->move);
+    node = child;
+  }
+
+  result.score = tree.nodes[0].score;
+  result.depth = tree.depth;
+  result.nodes = tree.size;
+  result.time = time_ms() - start;
+  free(tree.nodes);
+  free_queue(&tree.queue);
+  free(tree.thread);
+  return result;
 }
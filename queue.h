@@ -0,0 +1,42 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+
+#include "ai.h"
+
+// Tree size when the limits don't give a node budget: 64 MB of nodes and
+// 32 MB of queue.
+#define BEST_FIRST_DEFAULT_NODES (4 << 20)
+
+typedef struct BestFirstResult {
+  int score;
+  int depth; // Deepest expanded line.
+  uint64_t expansions;
+  uint64_t nodes; // Tree nodes, including the unexpanded leaves.
+  uint64_t time; // ms
+} BestFirstResult;
+
+// Best-first minimax: instead of searching every line to a fixed depth,
+// grows a tree by repeatedly expanding its most promising leaf, backing the
+// children's scores up to the root. Stops after limits->nodes tree nodes
+// (BEST_FIRST_DEFAULT_NODES if unset), limits->movetime or limits->stop.
+// best_moves (MAX_PLY long) gets the principal variation.
+BestFirstResult best_first_search(const Board* board, const SearchLimits* limits, Move* best_moves);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+FILE* search_stats_output = NULL;
+
+void merge_search_stats(SearchStats* into, const SearchStats* from) {
+  into->pv_nodes += from->pv_nodes;
+  into->cut_nodes += from->cut_nodes;
+  into->all_nodes += from->all_nodes;
+  into->quiescence_nodes += from->quiescence_nodes;
+  into->tt_cutoffs += from->tt_cutoffs;
+  into->fail_highs += from->fail_highs;
+  into->fail_high_first += from->fail_high_first;
+  into->null_move_tries += from->null_move_tries;
+  into->null_move_cutoffs += from->null_move_cutoffs;
+  into->lmr_reductions += from->lmr_reductions;
+  into->lmr_researches += from->lmr_researches;
+  into->evaluations += from->evaluations;
+  into->move_generations += from->move_generations;
+}
+
+double ratio(uint64_t part, uint64_t whole) {
+  return whole ? (double)part / whole : 0;
+}
+
+void write_search_stats(FILE* output, const SearchStats* stats, int depth, int score,
+                        uint64_t nodes, uint64_t time, uint64_t tt_probes, uint64_t tt_hits) {
+  // Effective branching factor: how many times more nodes the last iteration
+  // took than the one before it.
+  double branching = 0;
+  if(depth >= 2) {
+    uint64_t last = stats->iteration_nodes[depth] - stats->iteration_nodes[depth - 1];
+    uint64_t previous = stats->iteration_nodes[depth - 1] - stats->iteration_nodes[depth - 2];
+    branching = ratio(last, previous);
+  }
+  // Searches from several threads may write at once; keep each line whole.
+  flockfile(output);
+  fprintf(output, "{\"depth\": %d, \"score\": %d, \"nodes\": %llu, \"time_ms\": %llu, "
+          "\"nodes_by_type\": {\"pv\": %llu, \"cut\": %llu, \"all\": %llu, \"quiescence\": %llu}, "
+          "\"tt\": {\"probes\": %llu, \"hits\": %llu, \"cutoffs\": %llu}, "
+          "\"fail_highs\": %llu, \"fail_high_first_rate\": %.3f, "
+          "\"null_move\": {\"tries\": %llu, \"cutoffs\": %llu}, "
+          "\"lmr\": {\"reductions\": %llu, \"researches\": %llu}, "
+          "\"evaluations\": %llu, \"move_generations\": %llu, \"branching_factor\": %.2f, "
+          "\"iterations\": [",
+          depth, score, (unsigned long long)nodes, (unsigned long long)time,
+          (unsigned long long)stats->pv_nodes, (unsigned long long)stats->cut_nodes,
+          (unsigned long long)stats->all_nodes, (unsigned long long)stats->quiescence_nodes,
+          (unsigned long long)tt_probes, (unsigned long long)tt_hits, (unsigned long long)stats->tt_cutoffs,
+          (unsigned long long)stats->fail_highs, ratio(stats->fail_high_first, stats->fail_highs),
+          (unsigned long long)stats->null_move_tries, (unsigned long long)stats->null_move_cutoffs,
+          (unsigned long long)stats->lmr_reductions, (unsigned long long)stats->lmr_researches,
+          (unsigned long long)stats->evaluations, (unsigned long long)stats->move_generations,
+          branching);
+  for(int i=1; i<=depth && i<STATS_ITERATIONS; i++) {
+    fprintf(output, "%s{\"depth\": %d, \"nodes\": %llu, \"time_ms\": %llu}", i > 1 ? ", " : "", i,
+            (unsigned long long)(stats->iteration_nodes[i] - stats->iteration_nodes[i - 1]),
+            (unsigned long long)(stats->iteration_time[i] - stats->iteration_time[i - 1]));
+  }
+  fprintf(output, "]}\n");
+  fflush(output);
+  funlockfile(output);
+}
@@ -0,0 +1,65 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Search counters, for seeing where a search spends its nodes. They cost a
+// few percent, so they only exist when built with -DSEARCH_STATS (make
+// stats); otherwise STAT() compiles to nothing.
+#ifdef SEARCH_STATS
+#define STAT(thread, counter) ((thread)->stats.counter++)
+#else
+#define STAT(thread, counter) ((void)0)
+#endif
+
+// One more than the deepest iteration, MAX_SEARCH_DEPTH.
+#define STATS_ITERATIONS 65
+
+// Kept per thread and summed when the search ends.
+typedef struct SearchStats {
+  // Nodes that searched their moves: PV nodes have an open window, the
+  // others are cut nodes if they failed high and all nodes if they failed low.
+  uint64_t pv_nodes;
+  uint64_t cut_nodes;
+  uint64_t all_nodes;
+  uint64_t quiescence_nodes;
+  uint64_t tt_cutoffs;
+  // Cutoffs by a searched move, and how many of them by the first one.
+  uint64_t fail_highs;
+  uint64_t fail_high_first;
+  uint64_t null_move_tries;
+  uint64_t null_move_cutoffs;
+  uint64_t lmr_reductions;
+  uint64_t lmr_researches;
+  uint64_t evaluations;
+  uint64_t move_generations;
+  // Nodes and ms spent by the end of each completed iteration, main thread
+  // only; the rest of the counters cover every thread.
+  uint64_t iteration_nodes[STATS_ITERATIONS];
+  uint64_t iteration_time[STATS_ITERATIONS];
+} SearchStats;
+
+// Every search appends its counters here as one JSON line, if set.
+extern FILE* search_stats_output;
+
+void merge_search_stats(SearchStats* into, const SearchStats* from);
+void write_search_stats(FILE* output, const SearchStats* stats, int depth, int score,
+                        uint64_t nodes, uint64_t time, uint64_t tt_probes, uint64_t tt_hits);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "grubchess.h"
+#include "ai.h"
+#include "uci.h"
+
+#define UCI_MAX_HASH_MB 4096
+#define UCI_MAX_THREADS 256
+
+typedef struct UciState {
+  HashTable* table;
+  int threads;
+  const Book* book;
+  // Where the table is saved, set by -hashfile or the HashFile option.
+  char hashfile[4096];
+  Board board;
+
+  // The running search, if any.
+  pthread_t search;
+  bool searching;
+  SearchLimits limits;
+  // "go infinite" must not answer bestmove until told to stop.
+  bool infinite;
+  atomic_bool stop;
+} UciState;
+
+void print_uci_move(const Board* board, Move move) {
+  char text[6];
+  format_move(board, move, text);
+  printf("%s", text);
+}
+
+bool apply_uci_move(Board* board, const char* text) {
+  if(strlen(text) < 4) {
+    return false;
+  }
+  Move move = {{text[1] - '1', text[0] - 'a'}, {text[3] - '1', text[2] - 'a'}};
+  if(!position_valid(move.from) || !position_valid(move.to) || !move_valid(board, move)) {
+    return false;
+  }
+  bool promotion = is_promotion(board, move);
+  enum Color color = board->move;
+  apply_valid_move(board, move.from, move.to);
+  char* symbol = text[4] ? strchr(PIECE_SYMBOLS + 1, text[4] | 0x20) : NULL;
+  if(promotion && symbol != NULL && *symbol != 'k' && *symbol != 'p') {
+    // apply_valid_move always queens.
+    set_square(board, move.to, (Square) {symbol - PIECE_SYMBOLS, color});
+  }
+  return true;
+}
+
+void uci_info(const Board* board, const SearchResult* result, const Move* pv, void* data) {
+  int valence = board->move == WHITE ? 1 : -1;
+  int score = result->score * valence;
+  int length = 0;
+  while(length < MAX_PLY && pack_move(pv[length]) != 0) {
+    length++;
+  }
+  // The input thread answers commands meanwhile; keep each line whole.
+  flockfile(stdout);
+  printf("info depth %d score ", result->depth);
+  if(score_is_checkmate(score)) {
+    int plies = checkmate_plies(score);
+    printf("mate %d", score > 0 ? (plies + 1) / 2 : -(plies / 2));
+  } else {
+    printf("cp %d", score);
+  }
+  printf(" nodes %llu nps %llu time %llu pv", (unsigned long long)result->nodes,
+         (unsigned long long)(result->nodes * 1000 / (result->time ? result->time : 1)),
+         (unsigned long long)result->time);
+  Board position = *board;
+  for(int i=0; i<length; i++) {
+    printf(" ");
+    print_uci_move(&position, pv[i]);
+    apply_valid_move(&position, pv[i].from, pv[i].to);
+  }
+  printf("\n");
+  fflush(stdout);
+  funlockfile(stdout);
+}
+
+void* uci_search(void* data) {
+  UciState* state = (UciState*) data;
+  Move best_moves[MAX_PLY] = {{{0}}};
+  if(state->book && !state->infinite && probe_book(state->book, &state->board, &best_moves[0])) {
+    printf("info string book move\n");
+  } else {
+    new_search_hashtable(state->table);
+    parallel_search(state->table, &state->board, &state->limits, state->threads, best_moves, uci_info, NULL);
+  }
+  if(state->infinite) {
+    while(!atomic_load(&state->stop)) {
+      nanosleep(&(struct timespec) {0, 1000000}, NULL);
+    }
+  }
+  if(pack_move(best_moves[0]) == 0) {
+    // Stopped before the first iteration finished; any move beats none.
+    MoveList moves;
+    generate_moves(&state->board, &moves);
+    if(moves.count > 0) {
+      best_moves[0] = moves.moves[0];
+    }
+  }
+  flockfile(stdout);
+  printf("bestmove ");
+  if(pack_move(best_moves[0]) == 0) {
+    printf("0000");
+  } else {
+    print_uci_move(&state->board, best_moves[0]);
+  }
+  printf("\n");
+  fflush(stdout);
+  funlockfile(stdout);
+  return NULL;
+}
+
+void stop_search(UciState* state) {
+  if(state->searching) {
+    atomic_store(&state->stop, true);
+    pthread_join(state->search, NULL);
+    state->searching = false;
+  }
+}
+
+void uci_position(UciState* state, char* args) {
+  char* moves = strstr(args, "moves");
+  if(moves) {
+    *moves = '\0';
+    moves += strlen("moves");
+  }
+  if(strncmp(args, "startpos", 8) == 0) {
+    reset_board(&state->board);
+  } else if(strncmp(args, "fen", 3) == 0) {
+    char* fen = args + 3;
+    if(!parse_fen(&state->board, fen + strspn(fen, " "))) {
+      printf("info string invalid fen\n");
+      reset_board(&state->board);
+    }
+  }
+  for(char* move = moves ? strtok(moves, " ") : NULL; move; move = strtok(NULL, " ")) {
+    if(!apply_uci_move(&state->board, move)) {
+      printf("info string illegal move %s\n", move);
+      break;
+    }
+  }
+}
+
+void uci_go(UciState* state, char* args) {
+  SearchLimits limits = {0};
+  bool infinite = false;
+  // Keywords that take a value; the rest are flags, or moves after
+  // searchmoves, and are skipped.
+  const char* keywords[] = {"depth", "nodes", "movetime", "wtime", "btime", "winc", "binc", "movestogo", "mate"};
+  for(char* token = strtok(args, " "); token; token = strtok(NULL, " ")) {
+    if(strcmp(token, "infinite") == 0) {
+      infinite = true;
+      continue;
+    }
+    bool keyword = false;
+    for(int i=0; i<sizeof(keywords) / sizeof(keywords[0]); i++) {
+      keyword = keyword || strcmp(token, keywords[i]) == 0;
+    }
+    char* value = NULL;
+    if(!keyword) {
+      continue;
+    } else if((value = strtok(NULL, " ")) == NULL) {
+      break;
+    }
+    if(strcmp(token, "depth") == 0) {
+      limits.depth = atoi(value);
+    } else if(strcmp(token, "nodes") == 0) {
+      limits.nodes = strtoull(value, NULL, 10);
+    } else if(strcmp(token, "movetime") == 0) {
+      limits.movetime = atoi(value);
+    } else if(strcmp(token, "wtime") == 0) {
+      limits.time[WHITE] = atoi(value);
+    } else if(strcmp(token, "btime") == 0) {
+      limits.time[BLACK] = atoi(value);
+    } else if(strcmp(token, "winc") == 0) {
+      limits.increment[WHITE] = atoi(value);
+    } else if(strcmp(token, "binc") == 0) {
+      limits.increment[BLACK] = atoi(value);
+    } else if(strcmp(token, "movestogo") == 0) {
+      limits.moves_to_go = atoi(value);
+    }
+  }
+
+  stop_search(state);
+  atomic_store(&state->stop, false);
+  limits.stop = &state->stop;
+  state->limits = limits;
+  state->infinite = infinite;
+  state->searching = true;
+  pthread_create(&state->search, NULL, uci_search, state);
+}
+
+void uci_setoption(UciState* state, char* args) {
+  char* name = strstr(args, "name ");
+  char* value = strstr(args, " value ");
+  if(name == NULL) {
+    return;
+  }
+  stop_search(state);
+  // Buttons have no value.
+  if(strncmp(name + strlen("name "), "Clear Hash", 10) == 0) {
+    clear_hashtable(state->table);
+    return;
+  } else if(strncmp(name + strlen("name "), "Save Hash", 9) == 0) {
+    if(state->hashfile[0] && !save_hashtable(state->table, state->hashfile)) {
+      printf("info string unable to save hash to %s\n", state->hashfile);
+    }
+    return;
+  } else if(value == NULL) {
+    return;
+  }
+  int number = atoi(value + strlen(" value "));
+  if(strncmp(name + strlen("name "), "HashFile", 8) == 0) {
+    // Loads the file if there is one, and saves to it from now on.
+    snprintf(state->hashfile, sizeof(state->hashfile), "%s", value + strlen(" value "));
+    if(load_hashtable(state->table, state->hashfile)) {
+      printf("info string loaded hash from %s\n", state->hashfile);
+    }
+  } else if(strncmp(name + strlen("name "), "Hash", 4) == 0) {
+    if(number < 1) {
+      number = 1;
+    }
+    if(number > UCI_MAX_HASH_MB) {
+      number = UCI_MAX_HASH_MB;
+    }
+    free_hashtable(state->table);
+    init_hashtable(state->table, number);
+  } else if(strncmp(name + strlen("name "), "Threads", 7) == 0) {
+    if(number < 1) {
+      number = 1;
+    }
+    state->threads = number < UCI_MAX_THREADS ? number : UCI_MAX_THREADS;
+  } else if(strncmp(name + strlen("name "), "NullMove", 8) == 0) {
+    search_options.null_move = strncmp(value + strlen(" value "), "true", 4) == 0;
+  } else if(strncmp(name + strlen("name "), "LMR", 3) == 0) {
+    search_options.late_move_reductions = strncmp(value + strlen(" value "), "true", 4) == 0;
+  }
+}
+
+void uci_loop(HashTable* table, int threads, const Book* book, const char* hashfile) {
+  UciState* state = calloc(1, sizeof(UciState));
+  state->table = table;
+  state->threads = threads;
+  state->book = book;
+  if(hashfile) {
+    snprintf(state->hashfile, sizeof(state->hashfile), "%s", hashfile);
+  }
+  atomic_init(&state->stop, false);
+  reset_board(&state->board);
+
+  char line[16384];
+  while(fgets(line, sizeof(line), stdin)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    // Split the command from its arguments.
+    char* args = line + strcspn(line, " ");
+    if(*args) {
+      *args++ = '\0';
+    }
+    if(strcmp(line, "uci") == 0) {
+      printf("id name GrubChess\n");
+      printf("id author the GrubChess authors\n");
+      printf("option name Hash type spin default %d min 1 max %d\n", DEFAULT_HASH_MB, UCI_MAX_HASH_MB);
+      printf("option name Clear Hash type button\n");
+      printf("option name HashFile type string default %s\n", state->hashfile[0] ? state->hashfile : "<empty>");
+      printf("option name Save Hash type button\n");
+      printf("option name Threads type spin default %d min 1 max %d\n", threads, UCI_MAX_THREADS);
+      printf("option name NullMove type check default %s\n", search_options.null_move ? "true" : "false");
+      printf("option name LMR type check default %s\n", search_options.late_move_reductions ? "true" : "false");
+      printf("uciok\n");
+    } else if(strcmp(line, "isready") == 0) {
+      printf("readyok\n");
+    } else if(strcmp(line, "ucinewgame") == 0) {
+      // Keep the table; the last game's entries age out as this one fills it.
+      stop_search(state);
+      new_search_hashtable(state->table);
+    } else if(strcmp(line, "position") == 0) {
+      stop_search(state);
+      uci_position(state, args);
+    } else if(strcmp(line, "go") == 0) {
+      uci_go(state, args);
+    } else if(strcmp(line, "stop") == 0) {
+      stop_search(state);
+    } else if(strcmp(line, "setoption") == 0) {
+      uci_setoption(state, args);
+    } else if(strcmp(line, "quit") == 0) {
+      break;
+    }
+    fflush(stdout);
+  }
+  stop_search(state);
+  if(state->hashfile[0] && !save_hashtable(state->table, state->hashfile)) {
+    printf("info string unable to save hash to %s\n", state->hashfile);
+  }
+  free(state);
+}
@@ -0,0 +1,32 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef UCI_H
+#define UCI_H
+
+#include "book.h"
+#include "hashtable.h"
+
+// Speaks the Universal Chess Interface on stdin/stdout until "quit". The
+// search runs on its own thread, so "stop" and "isready" are answered while
+// it thinks. Positions found in book, if not NULL, are answered from it.
+// The table is kept across games; if hashfile is set it is saved there on
+// "quit".
+void uci_loop(HashTable* table, int threads, const Book* book, const char* hashfile);
+
+// Plays a move in coordinate notation (e2e4, e7e8n), if it's valid here.
+bool apply_uci_move(Board* board, const char* text);
+
+#endif